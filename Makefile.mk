@@ -27,7 +27,7 @@ endif
 INSTALLATION_PATH = $(DESTDIR)$(INSTALL_PATH)/tap-$(EFFECT_PATH)
 
 # sources and objects
-SRC = $(wildcard *.c)
+SRC ?= $(wildcard *.c)
 
 ## rules
 all: $(PLUGIN_SO)
@@ -40,4 +40,4 @@ clean:
 
 install: all
 	mkdir -p $(INSTALLATION_PATH)
-	cp -r *.so *.ttl modgui $(INSTALLATION_PATH)
+	cp -r *.so *.ttl $(wildcard modgui) $(INSTALLATION_PATH)
@@ -64,6 +64,11 @@
 /* bandwidth of highpass filters (in octaves) */
 #define HP_BW 1
 
+/* interpolation of the modulated delay lines */
+#ifndef DELAY_INTERP
+#define DELAY_INTERP FDELAY_HERMITE
+#endif
+
 /* cosine table for fast computations */
 #define COS_TABLE_SIZE 1024
 float cos_table[COS_TABLE_SIZE];
@@ -89,12 +94,10 @@ typedef struct {
 	float * output_L;
 	float * output_R;
 
-	float * ring_L;
-	unsigned long buflen_L;
-	unsigned long pos_L;
-	float * ring_R;
-	unsigned long buflen_R;
-	unsigned long pos_R;
+	fdelay line_L;
+	fdelay line_R;
+	float interp_state_L;
+	float interp_state_R;
 
 	biquad highpass_L;
 	biquad highpass_R;
@@ -124,15 +127,15 @@ instantiate_ChorusFlanger(const LV2_Descriptor * Descriptor, double sample_rate,
 
 		const unsigned long fullbuflen = (DEPTH_BUFLEN + DELAY_BUFLEN) * sample_rate / 192000;
 
-		if ((((ChorusFlanger *)ptr)->ring_L = calloc(fullbuflen, sizeof(float))) == NULL)
+		float * buffer;
+
+		if ((buffer = calloc(fullbuflen + FDELAY_GUARD, sizeof(float))) == NULL)
 			return NULL;
-		((ChorusFlanger *)ptr)->buflen_L = fullbuflen;
-		((ChorusFlanger *)ptr)->pos_L = 0;
+		fdelay_init(&((ChorusFlanger *)ptr)->line_L, buffer, fullbuflen);
 
-		if ((((ChorusFlanger *)ptr)->ring_R = calloc(fullbuflen, sizeof(float))) == NULL)
+		if ((buffer = calloc(fullbuflen + FDELAY_GUARD, sizeof(float))) == NULL)
 			return NULL;
-		((ChorusFlanger *)ptr)->buflen_R = fullbuflen;
-		((ChorusFlanger *)ptr)->pos_R = 0;
+		fdelay_init(&((ChorusFlanger *)ptr)->line_R, buffer, fullbuflen);
 
 
 		((ChorusFlanger *)ptr)->cm_phase = 0.0f;
@@ -157,8 +160,10 @@ activate_ChorusFlanger(LV2_Handle Instance) {
 
 	ChorusFlanger * ptr = (ChorusFlanger *)Instance;
 
-	memset(ptr->ring_L, 0, sizeof(float)*ptr->buflen_L);
-	memset(ptr->ring_R, 0, sizeof(float)*ptr->buflen_R);
+	fdelay_clear(&ptr->line_L);
+	fdelay_clear(&ptr->line_R);
+	ptr->interp_state_L = 0.0f;
+	ptr->interp_state_R = 0.0f;
 
 	biquad_init(&ptr->highpass_L);
 	biquad_init(&ptr->highpass_R);
@@ -266,11 +271,6 @@ run_ChorusFlanger(LV2_Handle Instance,
 	float phase_R = 0.0f;
 	float fpos_L = 0.0f;
 	float fpos_R = 0.0f;
-	float n_L = 0.0f;
-	float n_R = 0.0f;
-	float rem_L = 0.0f;
-	float rem_R = 0.0f;
-	float s_a_L, s_a_R, s_b_L, s_b_R;
 
 	float d_pos = 0.0f;
 
@@ -286,8 +286,8 @@ run_ChorusFlanger(LV2_Handle Instance,
 		in_L = *(input_L++);
 		in_R = *(input_R++);
 
-		push_buffer(in_L, ptr->ring_L, ptr->buflen_L, &(ptr->pos_L));
-		push_buffer(in_R, ptr->ring_R, ptr->buflen_R, &(ptr->pos_R));
+		fdelay_push(&ptr->line_L, in_L);
+		fdelay_push(&ptr->line_R, in_R);
 
 		ptr->cm_phase += freq / ptr->sample_rate * COS_TABLE_SIZE;
 
@@ -305,23 +305,8 @@ run_ChorusFlanger(LV2_Handle Instance,
 		fpos_L = d_pos + depth * (0.5f + 0.5f * cos_table[(unsigned long)phase_L]);
 		fpos_R = d_pos + depth * (0.5f + 0.5f * cos_table[(unsigned long)phase_R]);
 
-		n_L = floorf(fpos_L);
-		n_R = floorf(fpos_R);
-		rem_L = fpos_L - n_L;
-		rem_R = fpos_R - n_R;
-
-		s_a_L = read_buffer(ptr->ring_L, ptr->buflen_L,
-				    ptr->pos_L, (unsigned long) n_L);
-		s_b_L = read_buffer(ptr->ring_L, ptr->buflen_L,
-				    ptr->pos_L, (unsigned long) n_L + 1);
-
-		s_a_R = read_buffer(ptr->ring_R, ptr->buflen_R,
-				    ptr->pos_R, (unsigned long) n_R);
-		s_b_R = read_buffer(ptr->ring_R, ptr->buflen_R,
-				    ptr->pos_R, (unsigned long) n_R + 1);
-
-		d_L = ((1 - rem_L) * s_a_L + rem_L * s_b_L);
-		d_R = ((1 - rem_R) * s_a_R + rem_R * s_b_R);
+		d_L = fdelay_read_frac(&ptr->line_L, fpos_L, DELAY_INTERP, &ptr->interp_state_L);
+		d_R = fdelay_read_frac(&ptr->line_R, fpos_R, DELAY_INTERP, &ptr->interp_state_R);
 
 		f_L = biquad_run(&ptr->highpass_L, d_L);
 		f_R = biquad_run(&ptr->highpass_R, d_R);
@@ -340,8 +325,8 @@ void
 cleanup_ChorusFlanger(LV2_Handle Instance) {
 
   	ChorusFlanger * ptr = (ChorusFlanger *)Instance;
-	free(ptr->ring_L);
-	free(ptr->ring_R);
+	free(ptr->line_L.buffer);
+	free(ptr->line_R.buffer);
 	free(Instance);
 }
 
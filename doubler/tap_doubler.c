@@ -62,6 +62,11 @@
  */
 #define BUFLEN 11520
 
+/* interpolation of the drifting delay line */
+#ifndef DELAY_INTERP
+#define DELAY_INTERP FDELAY_ALLPASS
+#endif
+
 
 
 /* The structure used to hold port connection information and state */
@@ -85,13 +90,10 @@ typedef struct {
 	float old_time;
 	float old_pitch;
 
-	float * ring_L;
-	unsigned long buflen_L;
-	unsigned long pos_L;
-
-	float * ring_R;
-	unsigned long buflen_R;
-	unsigned long pos_R;
+	fdelay line_L;
+	fdelay line_R;
+	float interp_state_L;
+	float interp_state_R;
 
 	float * ring_pnoise;
 	unsigned long buflen_pnoise;
@@ -157,17 +159,16 @@ instantiate_Doubler(const LV2_Descriptor * Descriptor, double sample_rate, const
 		((Doubler *)ptr)->smoothdrylevel = 0.0;
 		((Doubler *)ptr)->smoothwetlevel = 0.0;
 
-		if ((((Doubler *)ptr)->ring_L =
-		     calloc(BUFLEN * sample_rate / 192000, sizeof(float))) == NULL)
+		unsigned long buflen = BUFLEN * sample_rate / 192000;
+		float * buffer;
+
+		if ((buffer = calloc(buflen + FDELAY_GUARD, sizeof(float))) == NULL)
 			return NULL;
-		((Doubler *)ptr)->buflen_L = BUFLEN * sample_rate / 192000;
-		((Doubler *)ptr)->pos_L = 0;
+		fdelay_init(&((Doubler *)ptr)->line_L, buffer, buflen);
 
-		if ((((Doubler *)ptr)->ring_R =
-		     calloc(BUFLEN * sample_rate / 192000, sizeof(float))) == NULL)
+		if ((buffer = calloc(buflen + FDELAY_GUARD, sizeof(float))) == NULL)
 			return NULL;
-		((Doubler *)ptr)->buflen_R = BUFLEN * sample_rate / 192000;
-		((Doubler *)ptr)->pos_R = 0;
+		fdelay_init(&((Doubler *)ptr)->line_R, buffer, buflen);
 
 		if ((((Doubler *)ptr)->ring_pnoise =
 		     calloc(NOISE_LEN, sizeof(float))) == NULL)
@@ -204,12 +205,11 @@ void
 activate_Doubler(LV2_Handle Instance) {
 
 	Doubler * ptr = (Doubler *)Instance;
-	unsigned long i;
 
-	for (i = 0; i < BUFLEN * ptr->sample_rate / 192000; i++) {
-		ptr->ring_L[i] = 0.0f;
-		ptr->ring_R[i] = 0.0f;
-	}
+	fdelay_clear(&ptr->line_L);
+	fdelay_clear(&ptr->line_R);
+	ptr->interp_state_L = 0.0f;
+	ptr->interp_state_R = 0.0f;
 
 	ptr->old_time = -1.0f;
 	ptr->old_pitch = -1.0f;
@@ -281,7 +281,7 @@ run_Doubler(LV2_Handle Instance,
 	float pitch = LIMIT(*(ptr->pitch),0.0f,1.0f) + 0.75f;
 	float depth = LIMIT(((1.0f - LIMIT(*(ptr->pitch),0.0f,1.0f)) * 1.75f + 0.25f) *
 				  ptr->sample_rate / 6000.0f / M_PI,
-				  0, ptr->buflen_L / 2);
+				  0, ptr->line_L.buflen / 2);
 	float time = LIMIT(*(ptr->time), 0.0f, 1.0f) + 0.5f;
 
 	float calcdry = (*(ptr->drylevel) +ptr->smoothdrylevel)*0.5;
@@ -310,9 +310,6 @@ run_Doubler(LV2_Handle Instance,
 	float out_R = 0.0f;
 
 	float fpos = 0.0f;
-	float n = 0.0f;
-	float rem = 0.0f;
-	float s_a_L, s_a_R, s_b_L, s_b_R;
 	float prev_p_pitch = 0.0f;
 	float prev_p_delay = 0.0f;
 	float delay;
@@ -354,8 +351,8 @@ run_Doubler(LV2_Handle Instance,
 		in_L = *(input_L++);
 		in_R = *(input_R++);
 
-		push_buffer(in_L, ptr->ring_L, ptr->buflen_L, &(ptr->pos_L));
-		push_buffer(in_R, ptr->ring_R, ptr->buflen_R, &(ptr->pos_R));
+		fdelay_push(&ptr->line_L, in_L);
+		fdelay_push(&ptr->line_R, in_R);
 
 		if (ptr->n_pitch < ptr->p_stretch) {
 			ptr->pitchmod += ptr->d_pitch;
@@ -388,24 +385,14 @@ run_Doubler(LV2_Handle Instance,
 		}
 
 		delay = (12.5f * ptr->delay + 37.5f) * ptr->sample_rate / 1000.0f;
-		fpos = ptr->buflen_L - depth * (1.0f - ptr->pitchmod) - delay - 1.0f;
-		n = floorf(fpos);
-		rem = fpos - n;
-
-		s_a_L = read_buffer(ptr->ring_L, ptr->buflen_L,
-				    ptr->pos_L, (unsigned long) n);
-		s_b_L = read_buffer(ptr->ring_L, ptr->buflen_L,
-				    ptr->pos_L, (unsigned long) n + 1);
-
-		s_a_R = read_buffer(ptr->ring_R, ptr->buflen_R,
-				    ptr->pos_R, (unsigned long) n);
-		s_b_R = read_buffer(ptr->ring_R, ptr->buflen_R,
-				    ptr->pos_R, (unsigned long) n + 1);
+		fpos = ptr->line_L.buflen - depth * (1.0f - ptr->pitchmod) - delay - 1.0f;
 
 		drystream_L = drylevel * in_L;
 		drystream_R = drylevel * in_R;
-		wetstream_L = wetlevel * ((1 - rem) * s_a_L + rem * s_b_L);
-		wetstream_R = wetlevel * ((1 - rem) * s_a_R + rem * s_b_R);
+		wetstream_L = wetlevel * fdelay_read_frac(&ptr->line_L, fpos,
+							  DELAY_INTERP, &ptr->interp_state_L);
+		wetstream_R = wetlevel * fdelay_read_frac(&ptr->line_R, fpos,
+							  DELAY_INTERP, &ptr->interp_state_R);
 
 		out_L = dryposl * drystream_L + (1.0f - dryposr) * drystream_R +
 			wetposl * wetstream_L + (1.0f - wetposr) * wetstream_R;
@@ -423,8 +410,8 @@ void
 cleanup_Doubler(LV2_Handle Instance) {
 
   	Doubler * ptr = (Doubler *)Instance;
-	free(ptr->ring_L);
-	free(ptr->ring_R);
+	free(ptr->line_L.buffer);
+	free(ptr->line_R.buffer);
 	free(ptr->ring_pnoise);
 	free(ptr->ring_dnoise);
 	free(Instance);
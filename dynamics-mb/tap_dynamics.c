@@ -0,0 +1 @@
+../dynamics/tap_dynamics.c
\ No newline at end of file
@@ -0,0 +1 @@
+../dynamics/tap_dynamics_presets.h
\ No newline at end of file
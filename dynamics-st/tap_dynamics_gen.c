@@ -0,0 +1 @@
+../dynamics/tap_dynamics_gen.c
\ No newline at end of file
@@ -24,8 +24,12 @@
 #include <stdint.h>
 #include <string.h>
 #include <math.h>
+#include <pthread.h>
 
 #include <lv2.h>
+#include <lv2/lv2plug.in/ns/ext/atom/atom.h>
+#include <lv2/lv2plug.in/ns/ext/atom/forge.h>
+#include <lv2/lv2plug.in/ns/ext/urid/urid.h>
 #include "tap_utils.h"
 
 
@@ -53,9 +57,11 @@ typedef signed int sample;
 #ifdef DYN_CALC_FLOAT
 typedef float dyn_t;
 typedef float rms_t;
+typedef double rms_acc_t;
 #else
 typedef sample dyn_t;
 typedef int64_t rms_t;
+typedef int64_t rms_acc_t;
 #endif
 
 
@@ -66,70 +72,125 @@ typedef int64_t rms_t;
 
 #define ID_STEREO         2153
 
-/* The port numbers for the plugin: */
+/* Max. number of channels of a linked instance (5.1) */
+#define MAX_CHANNELS      6
+
+/* The port numbers for the plugin.  An instance with n channels has
+   per-channel envelope and gain meters, a stereo link selector if
+   n > 1, the function selector and then its n inputs and n outputs;
+   n = 1 and n = 2 give the mono and stereo layouts.  Ports added later
+   are appended after the outputs. */
 
 #define ATTACK          0
 #define RELEASE         1
 #define OFFSGAIN        2
 #define MUGAIN          3
-#define RMSENV_L        4
-#define RMSENV_R        5
-#define MODGAIN_L       6
-#define MODGAIN_R       7
-#define STEREO          8
-#define MODE            9
-#define INPUT_L         10
-#define INPUT_R         11
-#define OUTPUT_L        12
-#define OUTPUT_R        13
-
-/* Definitions from mono dynamics */
-
-#define RMSENV_M          4
-#define MODGAIN_M         5
-#define MODE_M            6
-#define INPUT_M           7
-#define OUTPUT_M          8
-
+#define RMSENV(n,c)     (4 + (c))
+#define MODGAIN(n,c)    (4 + (n) + (c))
+#define STEREO(n)       (4 + 2 * (n))
+#define MODE(n)         (4 + 2 * (n) + ((n) > 1))
+#define INPUT(n,c)      (MODE(n) + 1 + (c))
+#define OUTPUT(n,c)     (MODE(n) + 1 + (n) + (c))
+#define LOOKAHEAD(n)    OUTPUT(n,n)
+#define LATENCY(n)      (LOOKAHEAD(n) + 1)
+#define DETECTOR(n)     (LATENCY(n) + 1)
+#define RMSWIN(n)       (DETECTOR(n) + 1)
+#define SC_SOURCE(n)    (RMSWIN(n) + 1)
+#define SC_HPF(n)       (SC_SOURCE(n) + 1)
+#define SC_LPF(n)       (SC_SOURCE(n) + 2)
+#define SC_INPUT(n,c)   (SC_SOURCE(n) + 3 + (c))
+#define NOTIFY(n)       SC_INPUT(n,n)
+#define METERINT(n)     (NOTIFY(n) + 1)
+#define LINKAMT(n)      (METERINT(n) + 1)   /* n == 2 only */
+#define MIDSIDE(n)      (METERINT(n) + 2)   /* n == 2 only */
 
 /* Total number of ports */
 
-#define PORTCOUNT_MONO   9
+#define PORTCOUNT(n)    (METERINT(n) + 1 + 2 * ((n) == 2))
 
-#define PORTCOUNT_STEREO   14
+/* Samples processed per pass */
+#define DYN_BLOCK       64
 
+/* Max. lookahead [ms] */
+#define LOOKAHEAD_MAX   10.0f
 
-#define TABSIZE 256
-#define RMSSIZE 64
+/* Level detectors */
+#define DETECT_RMS      0
+#define DETECT_PEAK     1
+#define DETECT_TRUEPEAK 2
 
+/* Limits of the RMS window [ms] */
+#define RMSWIN_MIN      1.0f
+#define RMSWIN_MAX      50.0f
 
-typedef struct {
-        rms_t        buffer[RMSSIZE];
-        unsigned int pos;
-        rms_t        sum_m;
-} rms_envMono;
+/* Taps per phase of the 4x oversampling true peak interpolator */
+#define TP_TAPS         8
 
-typedef struct {
-        rms_t        buffer[RMSSIZE];
-        unsigned int pos;
-        rms_t        sum;
-} rms_env;
+/* Sidechain filter ranges [Hz], the filters are off at the ends */
+#define SC_HPF_MIN      20.0f
+#define SC_HPF_MAX      2000.0f
+#define SC_LPF_MIN      500.0f
+#define SC_LPF_MAX      20000.0f
+
+/* bandwidth of the sidechain filters [octaves], about Q = 0.7 */
+#define SC_BW           1.9f
+
+/* scales peak levels so that a sine reads the same as with RMS */
+#define PEAK2RMS        0.70710678f
+
+/* Limits of the interval between meter events [ms] */
+#define METERINT_MIN    1.0f
+#define METERINT_MAX    1000.0f
 
+#define DYN_URI         "http://moddevices.com/plugins/tap/dynamics"
+#define DYN__Meter      DYN_URI "#Meter"
+#define DYN__envPeak    DYN_URI "#envPeak"
+#define DYN__envRms     DYN_URI "#envRms"
+#define DYN__gainPeak   DYN_URI "#gainPeak"
+#define DYN__gainRms    DYN_URI "#gainRms"
 
-/* max. number of breakpoints on in/out dB graph */
-#define MAX_POINTS 20
 
+/* range [ms] and resolution [entries per ms] of the attack/release
+   coefficient tables */
+#define AS_MAX          1000
+#define AS_RES          10
+#define AS_SIZE         (AS_MAX * AS_RES + 2)
+
+
+/* RMS of the last len values pushed, each of them the sum of the
+   squares of 4 samples.  The buffer holds the longest window at the
+   sample rate, so changing the window only resizes the running sum. */
 typedef struct {
-    float x;
-    float y;
-} GRAPH_POINT;
+        rms_t *       buffer;
+        unsigned long buflen;
+        unsigned long len;
+        unsigned long pos;
+        rms_acc_t     sum;
+        float         norm;
+} rms_env;
 
+/* input history of the true peak interpolator, stored twice so the
+   last TP_TAPS samples are always contiguous */
 typedef struct {
-    unsigned long num_points;
-    GRAPH_POINT points[MAX_POINTS];
-} DYNAMICS_DATA;
+        float        hist[2 * TP_TAPS];
+        unsigned int pos;
+} tpeak;
+
+/* one-pole coefficients for time constants of i / AS_RES ms at a
+   given sample rate, shared by every instance running at that rate.
+   A table outlives its last user, so that hosts creating and dropping
+   instances do not rebuild it each time; it goes when a table for
+   another rate is built, or when the library is unloaded. */
+typedef struct as_table {
+        double            sample_rate;
+        unsigned int      users;
+        struct as_table * next;
+        float             as[AS_SIZE];
+} as_table;
+
 
 #include "tap_dynamics_presets.h"
+#include "tap_dynamics_tables.h"
 
 
 /* The structure used to hold port connection information and state */
@@ -140,651 +201,1025 @@ typedef struct {
     float * offsgain;
     float * mugain;
     float smoothmugain;
-    float * rmsenv_L;
-    float * rmsenv_R;
-    float * modgain_L;
-    float * modgain_R;
+    float * rmsenv[MAX_CHANNELS];
+    float * modgain[MAX_CHANNELS];
     float * stereo;
     float * mode;
-    float * input_L;
-    float * output_L;
-    float * input_R;
-    float * output_R;
+    float * lookahead;
+    float * latency;
+    float * detector;
+    float * rmswin;
+    float * sc_source;
+    float * sc_hpf;
+    float * sc_lpf;
+    float * sc_input[MAX_CHANNELS];
+    float * input[MAX_CHANNELS];
+    float * output[MAX_CHANNELS];
+    LV2_Atom_Sequence * notify;
+    float * meterint;
+    float * linkamt;
+    float * midside;
     double sample_rate;
+    unsigned long channels;
+
+    float * la_buf;
+    unsigned long la_buflen;
+    unsigned long la_pos;
 
-    float * as;
+    as_table * as;
     unsigned long count;
-    dyn_t amp_L;
-    dyn_t amp_R;
-    dyn_t env_L;
-    dyn_t env_R;
-    float gain_L;
-    float gain_R;
-    float gain_out_L;
-    float gain_out_R;
-    rms_env * rms_L;
-    rms_env * rms_R;
-    rms_t sum_L;
-    rms_t sum_R;
-
-    /* variables from dynamics mono */
-
-    float * mugain_m;
-    float smoothmugain_m;
-    float * rmsenv_m;
-    float * modgain_m;
-    float * mode_m;
-    float * input_m;
-    float * output_m;
-
-    dyn_t amp_m;
-    dyn_t env_m;
-    float gain_m;
-    float gain_out_m;
-    rms_envMono * rms_m;
-    rms_t sum_m;
+    dyn_t amp[MAX_CHANNELS];
+    dyn_t env[MAX_CHANNELS];
+    float gain[MAX_CHANNELS];
+    float gain_out[MAX_CHANNELS];
+    rms_t sum[MAX_CHANNELS];
+    rms_env rms[MAX_CHANNELS];
+    rms_t * rms_buf;
+    float peak[MAX_CHANNELS];
+    tpeak tp[MAX_CHANNELS];
+    float tp_coef[3][TP_TAPS];
+    biquad sc_hp[MAX_CHANNELS];
+    biquad sc_lp[MAX_CHANNELS];
+    float old_hpf;
+    float old_lpf;
 
     DYNAMICS_DATA graph;
 
+    /* metering over the notify port, the envelope and the smoothed
+       gain applied at each 4 sample step are collected until the next
+       event */
+    LV2_URID_Map * map;
+    LV2_Atom_Forge forge;
+    LV2_URID uri_meter;
+    LV2_URID uri_env_peak;
+    LV2_URID uri_env_rms;
+    LV2_URID uri_gain_peak;
+    LV2_URID uri_gain_rms;
+    unsigned long meter_count;
+    float meter_env_peak[MAX_CHANNELS];
+    float meter_env_sq[MAX_CHANNELS];
+    float meter_gain_min[MAX_CHANNELS];
+    float meter_gain_max[MAX_CHANNELS];
+    float meter_gain_sq[MAX_CHANNELS];
+
 } Dynamics;
 
 
 
-/* RMS envelope stuff, grabbed without a second thought from Steve Harris's swh-plugins, util/rms.c */
-/* Adapted, though, to be able to use fixed-point arithmetics as well. */
+static as_table * as_tables = NULL;
+static pthread_mutex_t as_lock = PTHREAD_MUTEX_INITIALIZER;
 
-rms_envMono *
-rms_env_Mononew(void) {
 
-        rms_envMono * new = (rms_envMono *)calloc(1, sizeof(rms_envMono));
+/* free the tables without users, called with as_lock held */
+static void
+as_table_drop_unused(void) {
 
-        return new;
+        as_table ** p = &as_tables;
+        as_table * t;
+
+        while ((t = *p) != NULL) {
+                if (t->users == 0) {
+                        *p = t->next;
+                        free(t);
+                } else {
+                        p = &t->next;
+                }
+        }
 }
 
-void
-rms_env_Monoreset(rms_envMono *r) {
 
+/* returns the table for the sample rate, building it on first use */
+static as_table *
+as_table_get(double sample_rate) {
+
+        as_table * t;
         unsigned int i;
 
-        for (i = 0; i < RMSSIZE; i++) {
-                r->buffer[i] = 0.0f;
+        pthread_mutex_lock(&as_lock);
+        for (t = as_tables; t != NULL; t = t->next)
+                if (t->sample_rate == sample_rate)
+                        break;
+
+        /* the rate has changed: drop the tables nobody uses any more */
+        if (t == NULL)
+                as_table_drop_unused();
+
+        if (t == NULL && (t = malloc(sizeof(as_table))) != NULL) {
+                t->sample_rate = sample_rate;
+                t->users = 0;
+                t->as[0] = 0.0f;
+                for (i = 1; i < AS_SIZE; i++)
+                        t->as[i] = exp(-1000.0 * AS_RES / (sample_rate * i));
+                t->next = as_tables;
+                as_tables = t;
         }
-        r->pos = 0;
-        r->sum_m = 0.0f;
+        if (t != NULL)
+                t->users++;
+        pthread_mutex_unlock(&as_lock);
+
+        return t;
 }
 
-inline static
-dyn_t
-rms_env_Monoprocess(rms_envMono *r, const rms_t x) {
 
-        r->sum_m -= r->buffer[r->pos];
-        r->sum_m += x;
-        r->buffer[r->pos] = x;
-        r->pos = (r->pos + 1) & (RMSSIZE - 1);
+/* the table stays in the list when its last user goes, see as_table */
+static void
+as_table_put(as_table * t) {
 
-#ifdef DYN_CALC_FLOAT
-        return sqrt(r->sum_m / (float)RMSSIZE);
-#else
-        return sqrt(r->sum_m / RMSSIZE);
-#endif
+        pthread_mutex_lock(&as_lock);
+        t->users--;
+        pthread_mutex_unlock(&as_lock);
 }
 
-rms_env *
-rms_env_new(void) {
 
-        rms_env * new = (rms_env *)calloc(1, sizeof(rms_env));
+__attribute__((destructor))
+static void
+as_table_fini(void) {
 
-        return new;
+        pthread_mutex_lock(&as_lock);
+        as_table_drop_unused();
+        pthread_mutex_unlock(&as_lock);
 }
 
+
+/* coefficient for a time constant of t ms, interpolated between
+   the table entries */
+static inline float
+as_lookup(const as_table * t, float ms) {
+
+        float x;
+        unsigned int i;
+
+        if (ms <= 0.0f)
+                return 0.0f;
+        if (ms > (float)AS_MAX)
+                ms = (float)AS_MAX;
+
+        x = ms * (float)AS_RES;
+        i = (unsigned int)x;
+        x -= (float)i;
+        return t->as[i] + x * (t->as[i+1] - t->as[i]);
+}
+
+
+
+/* RMS envelope stuff, grabbed without a second thought from Steve Harris's swh-plugins, util/rms.c */
+/* Adapted, though, to be able to use fixed-point arithmetics as well. */
+
+/* Reworked for a window of variable length, with an O(1) update. */
+
 void
 rms_env_reset(rms_env *r) {
 
-        unsigned int i;
+        unsigned long i;
 
-        for (i = 0; i < RMSSIZE; i++) {
+        for (i = 0; i < r->buflen; i++) {
                 r->buffer[i] = 0.0f;
         }
         r->pos = 0;
         r->sum = 0.0f;
 }
 
+/* sum up the last len values from scratch */
+static
+void
+rms_env_set_len(rms_env *r, unsigned long len) {
+
+        unsigned long i;
+        unsigned long j = r->pos;
+
+        r->len = len;
+        r->norm = 1.0f / len;
+        r->sum = 0;
+        for (i = 0; i < len; i++) {
+                j = (j ? j : r->buflen) - 1;
+                r->sum += r->buffer[j];
+        }
+}
+
 inline static
 dyn_t
 rms_env_process(rms_env *r, const rms_t x) {
 
-        r->sum -= r->buffer[r->pos];
-        r->sum += x;
+        unsigned long old = (r->pos >= r->len) ?
+                r->pos - r->len : r->pos + r->buflen - r->len;
+
+        r->sum += x - r->buffer[old];
         r->buffer[r->pos] = x;
-        r->pos = (r->pos + 1) & (RMSSIZE - 1);
+        if (++r->pos >= r->buflen)
+                r->pos = 0;
 
 #ifdef DYN_CALC_FLOAT
-        return sqrt(r->sum / (float)RMSSIZE);
+        /* the int64 sum of the fixed-point mode is exact; in float mode,
+           start over once per buffer length so rounding errors cannot
+           pile up */
+        if (r->pos == 0)
+                rms_env_set_len(r, r->len);
+        return (r->sum > 0.0f) ? sqrtf(r->sum * r->norm) : 0.0f;
 #else
-        return sqrt(r->sum / RMSSIZE);
+        return sqrtf((float)r->sum * r->norm);
 #endif
 }
 
 
+/* windowed sinc interpolation at 1/4, 2/4 and 3/4 of the sample
+   interval in the middle of the TP_TAPS long input history */
+static
+void
+true_peak_init(float coef[3][TP_TAPS]) {
+
+        int p, k;
+        float u, w, norm;
+
+        for (p = 0; p < 3; p++) {
+                norm = 0.0f;
+                for (k = 0; k < TP_TAPS; k++) {
+                        u = TP_TAPS / 2 - 1 + (p + 1) * 0.25f - k;
+                        w = 0.5f + 0.5f * cosf(M_PI * u / (TP_TAPS / 2));
+                        coef[p][k] = w * sinf(M_PI * u) / (M_PI * u);
+                        norm += coef[p][k];
+                }
+                for (k = 0; k < TP_TAPS; k++)
+                        coef[p][k] /= norm;
+        }
+}
 
-inline
+/* push a sample and return the highest absolute value of it and the
+   points interpolated between the samples in the history */
+static inline
 float
-get_table_gain(int mode, float level) {
+true_peak(tpeak * t, float coef[3][TP_TAPS], float x) {
+
+        const float * h;
+        float peak = fabsf(x);
+        float y;
+        int p, k;
+
+        t->hist[t->pos] = t->hist[t->pos + TP_TAPS] = x;
+        t->pos = (t->pos + 1) & (TP_TAPS - 1);
+        h = t->hist + t->pos;
+
+        for (p = 0; p < 3; p++) {
+                y = 0.0f;
+                for (k = 0; k < TP_TAPS; k++)
+                        y += coef[p][k] * h[k];
+                y = fabsf(y);
+                if (y > peak)
+                        peak = y;
+        }
+        return peak;
+}
 
-    float x1 = -80.0f;
-    float y1 = -80.0f;
-    float x2 = 0.0f;
-    float y2 = 0.0f;
-    int i = 0;
 
-    if (level <= -80.0f)
-        return get_table_gain(mode, -79.9f);
 
-    while (i < dyn_data[mode].num_points && dyn_data[mode].points[i].x < level) {
-        x1 = dyn_data[mode].points[i].x;
-        y1 = dyn_data[mode].points[i].y;
-        i++;
-    }
-    if (i < dyn_data[mode].num_points) {
-        x2 = dyn_data[mode].points[i].x;
-        y2 = dyn_data[mode].points[i].y;
-    } else
-        return 0.0f;
+/* copy len samples into a ringbuffer, starting at pos */
+static inline
+void
+ring_write(float * buffer, unsigned long buflen, unsigned long pos,
+           const float * src, unsigned long len) {
+
+        unsigned long part = (pos + len > buflen) ? buflen - pos : len;
 
-    return y1 + ((level - x1) * (y2 - y1) / (x2 - x1)) - level;
+        memcpy(buffer + pos, src, part * sizeof(float));
+        memcpy(buffer, src + part, (len - part) * sizeof(float));
 }
 
+/* copy len samples out of a ringbuffer, starting at pos */
+static inline
+void
+ring_read(float * buffer, unsigned long buflen, unsigned long pos,
+          float * dst, unsigned long len) {
 
-LV2_Handle
-instantiate_MonoDynamics(const LV2_Descriptor * Descriptor, double sample_rate, const char* bundle_path, const LV2_Feature* const* features) {
+        unsigned long part = (pos + len > buflen) ? buflen - pos : len;
 
-    LV2_Handle * ptr;
+        memcpy(dst, buffer + pos, part * sizeof(float));
+        memcpy(dst + part, buffer, (len - part) * sizeof(float));
+}
 
-    float * as = NULL;
-    unsigned int count = 0;
-        dyn_t amp_m = 0.0f;
-    dyn_t env_m = 0.0f;
-    float gain_m = 0.0f;
-    float gain_out_m = 0.0f;
-    rms_envMono * rms_m = NULL;
-    rms_t sum_m = 0;
-    int i;
 
-    if ((ptr = malloc(sizeof(Dynamics))) == NULL)
-        return NULL;
+/* ends of the input level range covered by gain_table */
+#define GAIN_TAB_XMIN (1.0f / (1 << (1 - GAIN_TAB_EMIN)))
+#define GAIN_TAB_XMAX ((float)(1 << GAIN_TAB_EMAX))
 
-    ((Dynamics *)ptr)->sample_rate = sample_rate;
-    ((Dynamics *)ptr)->smoothmugain_m=0.0f;
-    ((Dynamics *)ptr)->smoothmugain=0.0f;
-        if ((rms_m = rms_env_Mononew()) == NULL)
-        return NULL;
+/* linear gain to apply at linear input level x, looked up in gain_table
+   by the exponent and mantissa of x, so no logarithm is taken */
+static inline
+float
+get_table_gain(int mode, float x) {
 
-        if ((as = malloc(TABSIZE * sizeof(float))) == NULL)
-        return NULL;
+    const float * tab = gain_table[mode];
+    float m, f;
+    int e, i;
+
+    if (!(x >= GAIN_TAB_XMIN)) /* also catches NaN */
+        return tab[0];
+    if (x >= GAIN_TAB_XMAX)
+        return tab[GAIN_TAB_SIZE - 1];
+    m = frexpf(x, &e);
+    f = (e - GAIN_TAB_EMIN) * GAIN_TAB_STEPS + (m - 0.5f) * (2 * GAIN_TAB_STEPS);
+    i = (int)f;
+
+    return tab[i] + (f - i) * (tab[i + 1] - tab[i]);
+}
 
-        as[0] = 1.0f;
-        for (i = 1; i < TABSIZE; i++) {
-        as[i] = expf(-1.0f / (sample_rate * (float)i / (float)TABSIZE));
+
+/* clear the meter accumulators */
+static void
+meter_reset(Dynamics * ptr) {
+
+        unsigned long c;
+
+        ptr->meter_count = 0;
+        for (c = 0; c < ptr->channels; c++) {
+                ptr->meter_env_peak[c] = 0.0f;
+                ptr->meter_env_sq[c] = 0.0f;
+                ptr->meter_gain_min[c] = 1.0f;
+                ptr->meter_gain_max[c] = 1.0f;
+                ptr->meter_gain_sq[c] = 0.0f;
         }
+}
 
-        ((Dynamics *)ptr)->as = as;
-        ((Dynamics *)ptr)->count = count;
-        ((Dynamics *)ptr)->amp_m = amp_m;
-        ((Dynamics *)ptr)->env_m = env_m;
-        ((Dynamics *)ptr)->gain_m = gain_m;
-        ((Dynamics *)ptr)->gain_out_m = gain_out_m;
-        ((Dynamics *)ptr)->rms_m = rms_m;
-        ((Dynamics *)ptr)->sum_m = sum_m;
 
-    return ptr;
+/* Append a meter event at the given frame.  Levels are in dB; the gain
+   peak is the gain farthest from 0 dB, so expansion shows up too.  The
+   forge writes into the host's buffer, nothing is allocated here. */
+static void
+meter_send(Dynamics * ptr, unsigned long n, int64_t frame) {
+
+        LV2_Atom_Forge * forge = &ptr->forge;
+        LV2_Atom_Forge_Frame obj;
+        const float norm = 1.0f / ptr->meter_count;
+        float env_peak[MAX_CHANNELS];
+        float env_rms[MAX_CHANNELS];
+        float gain_peak[MAX_CHANNELS];
+        float gain_rms[MAX_CHANNELS];
+        float lo, hi;
+        unsigned long c;
+
+        for (c = 0; c < n; c++) {
+                env_peak[c] = LIMIT(20.0f * log10f(ptr->meter_env_peak[c]), -60.0f, 20.0f);
+                env_rms[c] = LIMIT(10.0f * log10f(ptr->meter_env_sq[c] * norm), -60.0f, 20.0f);
+                lo = 20.0f * log10f(ptr->meter_gain_min[c]);
+                hi = 20.0f * log10f(ptr->meter_gain_max[c]);
+                gain_peak[c] = LIMIT((-lo > hi) ? lo : hi, -60.0f, 20.0f);
+                gain_rms[c] = LIMIT(10.0f * log10f(ptr->meter_gain_sq[c] * norm), -60.0f, 20.0f);
+        }
+        meter_reset(ptr);
+
+        /* an event that does not fit is left out as a whole */
+        if (forge->offset + sizeof(int64_t) + sizeof(LV2_Atom_Object)
+            + 4 * (2 * sizeof(uint32_t) + sizeof(LV2_Atom_Vector)
+                   + ((n * sizeof(float) + 7) & ~7)) > forge->size)
+                return;
+
+        lv2_atom_forge_frame_time(forge, frame);
+        lv2_atom_forge_object(forge, &obj, 0, ptr->uri_meter);
+        lv2_atom_forge_key(forge, ptr->uri_env_peak);
+        lv2_atom_forge_vector(forge, sizeof(float), forge->Float, n, env_peak);
+        lv2_atom_forge_key(forge, ptr->uri_env_rms);
+        lv2_atom_forge_vector(forge, sizeof(float), forge->Float, n, env_rms);
+        lv2_atom_forge_key(forge, ptr->uri_gain_peak);
+        lv2_atom_forge_vector(forge, sizeof(float), forge->Float, n, gain_peak);
+        lv2_atom_forge_key(forge, ptr->uri_gain_rms);
+        lv2_atom_forge_vector(forge, sizeof(float), forge->Float, n, gain_rms);
+        lv2_atom_forge_pop(forge, &obj);
 }
 
-/* Construct a new plugin instance. */
+
+/* Construct a new plugin instance with the given number of channels. */
+static
 LV2_Handle
-instantiate_StereoDynamics(const LV2_Descriptor * Descriptor, double sample_rate, const char* bundle_path, const LV2_Feature* const* features) {
+instantiate_Dynamics(double sample_rate, unsigned long channels,
+                     const LV2_Feature * const * features) {
+
+    Dynamics * ptr;
 
-    LV2_Handle * ptr;
-
-    float * as = NULL;
-    unsigned int count = 0;
-    dyn_t amp_L = 0.0f;
-    dyn_t amp_R = 0.0f;
-    dyn_t env_L = 0.0f;
-    dyn_t env_R = 0.0f;
-    float gain_L = 0.0f;
-    float gain_R = 0.0f;
-    float gain_out_L = 0.0f;
-    float gain_out_R = 0.0f;
-    rms_env * rms_L = NULL;
-    rms_env * rms_R = NULL;
-    rms_t sum_L = 0.0f;
-    rms_t sum_R = 0.0f;
+    unsigned long rms_buflen;
+    unsigned long c;
     int i;
 
-    if ((ptr = malloc(sizeof(Dynamics))) == NULL)
+    if ((ptr = calloc(1, sizeof(Dynamics))) == NULL)
         return NULL;
 
-    ((Dynamics *)ptr)->sample_rate = sample_rate;
+    ptr->sample_rate = sample_rate;
+    ptr->channels = channels;
 
-        if ((rms_L = rms_env_new()) == NULL)
-        return NULL;
-        if ((rms_R = rms_env_new()) == NULL)
+    /* the audio is delayed by the lookahead time, so the gain computer
+       sees the signal ahead of what is being output */
+    ptr->la_buflen = (unsigned long)(sample_rate * LOOKAHEAD_MAX / 1000.0f) + DYN_BLOCK;
+    if ((ptr->la_buf = calloc(channels * ptr->la_buflen, sizeof(float))) == NULL) {
+        free(ptr);
         return NULL;
+    }
 
-        if ((as = malloc(TABSIZE * sizeof(float))) == NULL)
+    /* the RMS window is set in ms, the buffers hold the longest one */
+    rms_buflen = (unsigned long)(sample_rate * RMSWIN_MAX / 4000.0f) + 1;
+    if ((ptr->rms_buf = calloc(channels * rms_buflen, sizeof(rms_t))) == NULL) {
+        free(ptr->la_buf);
+        free(ptr);
         return NULL;
+    }
+    for (c = 0; c < channels; c++) {
+        ptr->rms[c].buffer = ptr->rms_buf + c * rms_buflen;
+        ptr->rms[c].buflen = rms_buflen;
+        rms_env_set_len(&ptr->rms[c], 1);
+    }
 
-        as[0] = 1.0f;
-        for (i = 1; i < TABSIZE; i++) {
-        as[i] = expf(-1.0f / (sample_rate * (float)i / (float)TABSIZE));
-        }
+    true_peak_init(ptr->tp_coef);
 
-        ((Dynamics *)ptr)->as = as;
-        ((Dynamics *)ptr)->count = count;
-        ((Dynamics *)ptr)->amp_L = amp_L;
-        ((Dynamics *)ptr)->amp_R = amp_R;
-        ((Dynamics *)ptr)->env_L = env_L;
-        ((Dynamics *)ptr)->env_R = env_R;
-        ((Dynamics *)ptr)->gain_L = gain_L;
-        ((Dynamics *)ptr)->gain_R = gain_R;
-        ((Dynamics *)ptr)->gain_out_L = gain_out_L;
-        ((Dynamics *)ptr)->gain_out_R = gain_out_R;
-        ((Dynamics *)ptr)->rms_L = rms_L;
-        ((Dynamics *)ptr)->rms_R = rms_R;
-        ((Dynamics *)ptr)->sum_L = sum_L;
-        ((Dynamics *)ptr)->sum_R = sum_R;
+    if ((ptr->as = as_table_get(sample_rate)) == NULL) {
+        free(ptr->rms_buf);
+        free(ptr->la_buf);
+        free(ptr);
+        return NULL;
+    }
 
-    return ptr;
+    /* metering needs the URID map, without it the notify port stays empty */
+    for (i = 0; features && features[i]; i++) {
+        if (!strcmp(features[i]->URI, LV2_URID__map))
+            ptr->map = (LV2_URID_Map *)features[i]->data;
+    }
+    if (ptr->map) {
+        lv2_atom_forge_init(&ptr->forge, ptr->map);
+        ptr->uri_meter = ptr->map->map(ptr->map->handle, DYN__Meter);
+        ptr->uri_env_peak = ptr->map->map(ptr->map->handle, DYN__envPeak);
+        ptr->uri_env_rms = ptr->map->map(ptr->map->handle, DYN__envRms);
+        ptr->uri_gain_peak = ptr->map->map(ptr->map->handle, DYN__gainPeak);
+        ptr->uri_gain_rms = ptr->map->map(ptr->map->handle, DYN__gainRms);
+    }
+    meter_reset(ptr);
+
+    return (LV2_Handle)ptr;
 }
 
-void
-activate_Dynamics(LV2_Handle Instance) {
+LV2_Handle
+instantiate_MonoDynamics(const LV2_Descriptor * Descriptor, double sample_rate, const char* bundle_path, const LV2_Feature* const* features) {
+
+    return instantiate_Dynamics(sample_rate, 1, features);
+}
 
+LV2_Handle
+instantiate_StereoDynamics(const LV2_Descriptor * Descriptor, double sample_rate, const char* bundle_path, const LV2_Feature* const* features) {
 
+    return instantiate_Dynamics(sample_rate, 2, features);
 }
 
-void
-deactivate_Dynamics(LV2_Handle Instance) {
+LV2_Handle
+instantiate_QuadDynamics(const LV2_Descriptor * Descriptor, double sample_rate, const char* bundle_path, const LV2_Feature* const* features) {
 
+    return instantiate_Dynamics(sample_rate, 4, features);
+}
+
+LV2_Handle
+instantiate_SurroundDynamics(const LV2_Descriptor * Descriptor, double sample_rate, const char* bundle_path, const LV2_Feature* const* features) {
 
+    return instantiate_Dynamics(sample_rate, 6, features);
 }
 
 void
-connect_port_MonoDynamics(LV2_Handle Instance,
-             uint32_t Port,
-             void * DataLocation) {
+activate_Dynamics(LV2_Handle Instance) {
 
     Dynamics * ptr = (Dynamics *)Instance;
 
-    switch (Port) {
-    case ATTACK:
-        ptr->attack = (float*) DataLocation;
-        break;
-    case RELEASE:
-        ptr->release = (float*) DataLocation;
-        break;
-    case OFFSGAIN:
-        ptr->offsgain = (float*) DataLocation;
-        break;
-    case MUGAIN:
-        ptr->mugain_m = (float*) DataLocation;
-        break;
-    case RMSENV_M:
-        ptr->rmsenv_m = (float*) DataLocation;
-        // *(ptr->rmsenv_m) = -60.0f;
-        break;
-    case MODGAIN_M:
-        ptr->modgain_m = (float*) DataLocation;
-        // *(ptr->modgain_m) = 0.0f;
-        break;
-    case MODE_M:
-        ptr->mode_m = (float*) DataLocation;
-        break;
-    case INPUT_M:
-        ptr->input_m = (float*) DataLocation;
-        break;
-    case OUTPUT_M:
-        ptr->output_m = (float*) DataLocation;
-        break;
+    unsigned long c;
+
+    memset(ptr->la_buf, 0, ptr->channels * ptr->la_buflen * sizeof(float));
+    ptr->la_pos = 0;
+
+    for (c = 0; c < ptr->channels; c++) {
+        rms_env_reset(&ptr->rms[c]);
+        rms_env_set_len(&ptr->rms[c], ptr->rms[c].len);
+        memset(&ptr->tp[c], 0, sizeof(tpeak));
+        ptr->peak[c] = 0.0f;
+        biquad_init(&ptr->sc_hp[c]);
+        biquad_init(&ptr->sc_lp[c]);
     }
+    meter_reset(ptr);
+}
+
+void
+deactivate_Dynamics(LV2_Handle Instance) {
+
+
 }
 
 /* Connect a port to a data location. */
 void
-connect_port_StereoDynamics(LV2_Handle Instance,
+connect_port_Dynamics(LV2_Handle Instance,
              uint32_t Port,
              void * DataLocation) {
 
     Dynamics * ptr = (Dynamics *)Instance;
+    const unsigned long n = ptr->channels;
 
     switch (Port) {
     case ATTACK:
         ptr->attack = (float*) DataLocation;
-        break;
+        return;
     case RELEASE:
         ptr->release = (float*) DataLocation;
-        break;
+        return;
     case OFFSGAIN:
         ptr->offsgain = (float*) DataLocation;
-        break;
+        return;
     case MUGAIN:
         ptr->mugain = (float*) DataLocation;
-        break;
-    case RMSENV_L:
-        ptr->rmsenv_L = (float*) DataLocation;
-        // *(ptr->rmsenv_L) = -60.0f;
-        break;
-    case RMSENV_R:
-        ptr->rmsenv_R = (float*) DataLocation;
-        // *(ptr->rmsenv_R) = -60.0f;
-        break;
-    case MODGAIN_L:
-        ptr->modgain_L = (float*) DataLocation;
-        // *(ptr->modgain_L) = 0.0f;
-        break;
-    case MODGAIN_R:
-        ptr->modgain_R = (float*) DataLocation;
-        // *(ptr->modgain_R) = 0.0f;
-        break;
-    case STEREO:
+        return;
+    }
+
+    if (Port < MODGAIN(n,0))
+        ptr->rmsenv[Port - RMSENV(n,0)] = (float*) DataLocation;
+    else if (Port < MODGAIN(n,n))
+        ptr->modgain[Port - MODGAIN(n,0)] = (float*) DataLocation;
+    else if (n > 1 && Port == STEREO(n))
         ptr->stereo = (float*) DataLocation;
-        break;
-    case MODE:
+    else if (Port == MODE(n))
         ptr->mode = (float*) DataLocation;
-        break;
-    case INPUT_L:
-        ptr->input_L = (float*) DataLocation;
-        break;
-    case OUTPUT_L:
-        ptr->output_L = (float*) DataLocation;
-        break;
-    case INPUT_R:
-        ptr->input_R = (float*) DataLocation;
-        break;
-    case OUTPUT_R:
-        ptr->output_R = (float*) DataLocation;
-        break;
-    }
+    else if (Port < INPUT(n,n))
+        ptr->input[Port - INPUT(n,0)] = (float*) DataLocation;
+    else if (Port < OUTPUT(n,n))
+        ptr->output[Port - OUTPUT(n,0)] = (float*) DataLocation;
+    else if (Port == LOOKAHEAD(n))
+        ptr->lookahead = (float*) DataLocation;
+    else if (Port == LATENCY(n))
+        ptr->latency = (float*) DataLocation;
+    else if (Port == DETECTOR(n))
+        ptr->detector = (float*) DataLocation;
+    else if (Port == RMSWIN(n))
+        ptr->rmswin = (float*) DataLocation;
+    else if (Port == SC_SOURCE(n))
+        ptr->sc_source = (float*) DataLocation;
+    else if (Port == SC_HPF(n))
+        ptr->sc_hpf = (float*) DataLocation;
+    else if (Port == SC_LPF(n))
+        ptr->sc_lpf = (float*) DataLocation;
+    else if (Port < SC_INPUT(n,n))
+        ptr->sc_input[Port - SC_INPUT(n,0)] = (float*) DataLocation;
+    else if (Port == NOTIFY(n))
+        ptr->notify = (LV2_Atom_Sequence*) DataLocation;
+    else if (Port == METERINT(n))
+        ptr->meterint = (float*) DataLocation;
+    else if (n == 2 && Port == LINKAMT(n))
+        ptr->linkamt = (float*) DataLocation;
+    else if (n == 2 && Port == MIDSIDE(n))
+        ptr->midside = (float*) DataLocation;
 }
 
+/* The settings of a run() call, worked out once by dyn_begin() so
+   that the multiband plugin can feed a band in pieces without redoing
+   them, or smoothing the makeup gain, for every piece. */
+typedef struct {
+        float offsgain;
+        float mugain;
+        int stereo;
+        float linkamt;
+        int ms;
+        int mode;
+        unsigned long delay;
+        int detector;
+        int sc_ext;
+        int hp_on;
+        int lp_on;
+        int meter;
+        unsigned long meter_len;
+        float ga;
+        float gr;
+        float adjust[MAX_CHANNELS]; /* last output of the gain computer */
+        LV2_Atom_Forge_Frame seq;
+} DYN_RUN;
+
+/* The processing core, shared by all channel counts, in three parts:
+   dyn_begin() reads the control ports, dyn_process() runs the samples
+   (in one go, or in pieces) and dyn_end() writes the output ports.
+   They are always inlined into the run_*() functions below with a
+   constant n, so the compiler unrolls the per-channel loops and keeps
+   the state in registers as it did with the hand-written mono and
+   stereo code. */
+static inline __attribute__((always_inline))
 void
-run_MonoDynamics(LV2_Handle Instance,
-         uint32_t sample_count) {
+dyn_begin(Dynamics * ptr, DYN_RUN * r, const unsigned long n) {
 
-    Dynamics * ptr = (Dynamics *)Instance;
-    float * input_m = ptr->input_m;
-    float * output_m = ptr->output_m;
         const float attack = LIMIT(*(ptr->attack), 4.0f, 500.0f);
         const float release = LIMIT(*(ptr->release), 4.0f, 1000.0f);
-        const float offsgain = LIMIT(*(ptr->offsgain), -20.0f, 20.0f);
+        float calcmugain = (*(ptr->mugain)+ptr->smoothmugain)*0.5;
+        const float sc_hpf = LIMIT(*(ptr->sc_hpf), SC_HPF_MIN, SC_HPF_MAX);
+        const float sc_lpf = LIMIT(*(ptr->sc_lpf), SC_LPF_MIN, SC_LPF_MAX);
+        unsigned long rms_len = LIMIT(*(ptr->rmswin), RMSWIN_MIN, RMSWIN_MAX)
+                * ptr->sample_rate / 4000.0f + 0.5f;
+        unsigned long c;
+
+        ptr->smoothmugain=calcmugain;
+        r->mugain = db2lin(LIMIT(calcmugain, -20.0f, 20.0f));
+        r->offsgain = db2lin(LIMIT(*(ptr->offsgain), -20.0f, 20.0f));
+        r->stereo = (n > 1) ? LIMIT(*(ptr->stereo), 0, 2) : 0;
+        r->linkamt = (n == 2) ? LIMIT(*(ptr->linkamt), 0.0f, 100.0f) * 0.01f : 1.0f;
+        r->ms = (n == 2) ? LIMIT(*(ptr->midside), 0, 1) : 0;
+        r->mode = LIMIT(*(ptr->mode), 0, NUM_MODES-1);
+        r->delay = LIMIT(*(ptr->lookahead), 0.0f, LOOKAHEAD_MAX)
+                * ptr->sample_rate / 1000.0f;
+        r->detector = LIMIT(*(ptr->detector), 0, 2);
+        r->sc_ext = LIMIT(*(ptr->sc_source), 0, 1);
+        r->hp_on = sc_hpf > SC_HPF_MIN;
+        r->lp_on = sc_lpf < SC_LPF_MAX && sc_lpf < 0.45f * ptr->sample_rate;
+        r->meter = ptr->notify != NULL && ptr->map != NULL;
+        r->meter_len = 0;
+        r->ga = as_lookup(ptr->as, attack);
+        r->gr = as_lookup(ptr->as, release);
+
+        if (r->delay > ptr->la_buflen - DYN_BLOCK)
+                r->delay = ptr->la_buflen - DYN_BLOCK;
+        if (rms_len > ptr->rms[0].buflen)
+                rms_len = ptr->rms[0].buflen;
+
+        /* the sidechain inputs are optional, detect from the
+           plugin's own inputs if the host left them unconnected */
+        for (c = 0; c < n; c++)
+                if (ptr->sc_input[c] == NULL)
+                        r->sc_ext = 0;
+
+        if (r->hp_on && ptr->old_hpf != sc_hpf) {
+                for (c = 0; c < n; c++)
+                        hp_set_params(&ptr->sc_hp[c], sc_hpf, SC_BW, ptr->sample_rate);
+                ptr->old_hpf = sc_hpf;
+        }
+        if (r->lp_on && ptr->old_lpf != sc_lpf) {
+                for (c = 0; c < n; c++)
+                        lp_set_params(&ptr->sc_lp[c], sc_lpf, SC_BW, ptr->sample_rate);
+                ptr->old_lpf = sc_lpf;
+        }
 
-        float calcmugain_m = (*(ptr->mugain_m)+ptr->smoothmugain_m)*0.5;
-        ptr->smoothmugain_m=calcmugain_m;
-        const float mugain_m = db2lin(LIMIT(calcmugain_m, -20.0f, 20.0f));
-    const int mode_m = LIMIT(*(ptr->mode_m), 0, NUM_MODES-1);
-    unsigned long sample_index;
+        /* the host sets the size of the notify atom to the capacity */
+        if (r->meter) {
+                lv2_atom_forge_set_buffer(&ptr->forge, (uint8_t *)ptr->notify,
+                                          ptr->notify->atom.size);
+                lv2_atom_forge_sequence_head(&ptr->forge, &r->seq, 0);
+                r->meter_len = LIMIT(*(ptr->meterint), METERINT_MIN, METERINT_MAX)
+                        * ptr->sample_rate / 4000.0f + 0.5f;
+                if (r->meter_len < 1)
+                        r->meter_len = 1;
+        } else if (ptr->notify) {
+                /* without the map the Sequence URID is unknown: the type
+                   is left as the host set it, under an empty body */
+                if (ptr->notify->atom.size >= sizeof(LV2_Atom_Sequence_Body)) {
+                        ptr->notify->atom.size = sizeof(LV2_Atom_Sequence_Body);
+                        ptr->notify->body.unit = 0;
+                        ptr->notify->body.pad = 0;
+                } else {
+                        ptr->notify->atom.size = 0;
+                }
+        }
 
-        dyn_t amp_m = ptr->amp_m;
-        dyn_t env_m = ptr->env_m;
-        float * as = ptr->as;
+        for (c = 0; c < n; c++) {
+                if (ptr->rms[c].len != rms_len)
+                        rms_env_set_len(&ptr->rms[c], rms_len);
+                r->adjust[c] = 1.0f;
+        }
+}
+
+/* Process sample_count samples from the start of the port buffers;
+   frame is their offset in the host's block, for the meter events. */
+static inline __attribute__((always_inline))
+void
+dyn_process(Dynamics * ptr, DYN_RUN * r, uint32_t sample_count,
+            unsigned long frame, const unsigned long n) {
+
+        const float offsgain = r->offsgain;
+        const float mugain = r->mugain;
+        const int stereo = (n > 1) ? r->stereo : 0;
+        const float linkamt = (n == 2) ? r->linkamt : 1.0f;
+        const int ms = (n == 2) ? r->ms : 0;
+        const int mode = r->mode;
+        const unsigned long la_buflen = ptr->la_buflen;
+        const unsigned long delay = r->delay;
+        unsigned long la_pos = ptr->la_pos;
+        const int detector = r->detector;
+        const int hp_on = r->hp_on;
+        const int lp_on = r->lp_on;
+        const int meter = r->meter;
+        const unsigned long meter_len = r->meter_len;
+        unsigned long i, j, k, len, start, next, stop;
+        unsigned long c;
+
+        float * input[MAX_CHANNELS];
+        float * output[MAX_CHANNELS];
+        float * detect[MAX_CHANNELS];
+        dyn_t amp[MAX_CHANNELS];
+        dyn_t env[MAX_CHANNELS];
+        float gain[MAX_CHANNELS];
+        float gain_out[MAX_CHANNELS];
+        rms_t sum[MAX_CHANNELS];
+        float peak[MAX_CHANNELS];
         unsigned int count = ptr->count;
-        float gain_m = ptr->gain_m;
-        float gain_out_m = ptr->gain_out_m;
-        rms_envMono * rms_m = ptr->rms_m;
-        rms_t sum_m = ptr->sum_m;
 
-        const float ga = as[(unsigned int)(attack * 0.001f * (float)(TABSIZE-1))];
-        const float gr = as[(unsigned int)(release * 0.001f * (float)(TABSIZE-1))];
+        const float ga = r->ga;
+        const float gr = r->gr;
         const float ef_a = ga * 0.25f;
         const float ef_ai = 1.0f - ef_a;
 
-    float level = 0.0f;
-    float adjust = 0.0f;
-
-        for (sample_index = 0; sample_index < sample_count; sample_index++) {
+        float g[MAX_CHANNELS][DYN_BLOCK] __attribute__((aligned(16)));
+        float dly[2][DYN_BLOCK] __attribute__((aligned(16)));
+        float * adjust = r->adjust;
+        float link;
+
+        for (c = 0; c < n; c++) {
+                input[c] = ptr->input[c];
+                output[c] = ptr->output[c];
+                detect[c] = r->sc_ext ? ptr->sc_input[c] : ptr->input[c];
+                amp[c] = ptr->amp[c];
+                env[c] = ptr->env[c];
+                gain[c] = ptr->gain[c];
+                gain_out[c] = ptr->gain_out[c];
+                sum[c] = ptr->sum[c];
+                peak[c] = ptr->peak[c];
+        }
 
+        for (i = 0; i < sample_count; i += len) {
+                len = sample_count - i;
+                if (len > DYN_BLOCK)
+                        len = DYN_BLOCK;
+
+                /* detector, envelope, gain computer (every 4th sample) and
+                   gain smoother, in runs up to the next 4th sample; the
+                   smoothed gain of each sample goes to g[][] */
+                for (j = 0; j < len; ) {
+                        start = j;
+                        next = j + 3 - ((count + j) & 3);
+                        stop = (next < len) ? next + 1 : len;
+
+                        for (; j < stop; j++) {
+                                for (c = 0; c < n; c++) {
+                                        float x = detect[c][i + j];
+                                        float y;
+                                        float coef;
+
+                                        /* mid/side: channel 0 detects M, channel 1 detects S */
+                                        if (ms)
+                                                x = 0.5f * (c ? detect[0][i + j] - x
+                                                              : x + detect[1][i + j]);
+
+                                        if (hp_on)
+                                                x = biquad_run(&ptr->sc_hp[c], x);
+                                        if (lp_on)
+                                                x = biquad_run(&ptr->sc_lp[c], x);
+
+                                        switch (detector) {
+                                        case DETECT_RMS:
 #ifdef DYN_CALC_FLOAT
-        sum_m += input_m[sample_index] * input_m[sample_index];
-        if (amp_m > env_m) {
-            env_m = env_m * ga + amp_m * (1.0f - ga);
-        } else {
-            env_m = env_m * gr + amp_m * (1.0f - gr);
-        }
+                                                sum[c] += x * x;
 #else
-        sum_m += (rms_t)(input_m[sample_index] * F2S * input_m[sample_index] * F2S);
-        if (amp_m) {
-            if (amp_m > env_m) {
-                env_m = (double)env_m * ga + (double)amp_m * (1.0f - ga);
-            } else {
-                env_m = (double)env_m * gr + (double)amp_m * (1.0f - gr);
-            }
-        } else
-            env_m = 0;
+                                                sum[c] += (rms_t)(x * F2S) * (rms_t)(x * F2S);
 #endif
-
-        if (count++ % 4 == 3) {
+                                                break;
+                                        case DETECT_PEAK:
+                                                y = fabsf(x);
+                                                if (y > peak[c])
+                                                        peak[c] = y;
+                                                break;
+                                        case DETECT_TRUEPEAK:
+                                                y = true_peak(&ptr->tp[c], ptr->tp_coef, x);
+                                                if (y > peak[c])
+                                                        peak[c] = y;
+                                                break;
+                                        }
+
+                                        coef = (amp[c] > env[c]) ? ga : gr;
 #ifdef DYN_CALC_FLOAT
-            amp_m = rms_env_Monoprocess(rms_m, sum_m / 4);
+                                        env[c] = env[c] * coef + amp[c] * (1.0f - coef);
 #else
-            if (sum_m)
-                amp_m = rms_env_Monoprocess(rms_m, sum_m / 4);
-            else
-                amp_m = 0;
+                                        env[c] = amp[c] ? (double)env[c] * coef
+                                                + (double)amp[c] * (1.0f - coef) : 0;
 #endif
+                                }
+                        }
+
+                        for (c = 0; c < n; c++)
+                                for (k = start; k < stop && k < next; k++)
+                                        g[c][k] = gain[c] =
+                                                gain[c] * ef_a + gain_out[c] * ef_ai;
 
+                        if (stop == next + 1) {
+                                for (c = 0; c < n; c++) {
+                                        if (detector != DETECT_RMS) {
 #ifdef DYN_CALC_FLOAT
-            if (isnan(amp_m))
-                amp_m = 0.0f;
+                                                amp[c] = peak[c] * PEAK2RMS;
+#else
+                                                amp[c] = peak[c] * PEAK2RMS * F2S;
 #endif
-            sum_m = 0;
-
-            /* set gain_out_m according to the difference between
-               the env_melope volume level (env_m) and the corresponding
-               output_m level (from graph) */
+                                                peak[c] = 0.0f;
+                                        } else {
 #ifdef DYN_CALC_FLOAT
-            level = 20 * log10f(2 * env_m);
+                                                amp[c] = rms_env_process(&ptr->rms[c],
+                                                                         sum[c] * 0.25f);
+                                                if (isnan(amp[c]))
+                                                        amp[c] = 0.0f;
 #else
-            level = 20 * log10f(2 * (double)env_m / (double)F2S);
+                                                if (sum[c])
+                                                        amp[c] = rms_env_process(&ptr->rms[c],
+                                                                                 sum[c] * 0.25f);
+                                                else
+                                                        amp[c] = 0;
 #endif
-            adjust = get_table_gain(mode_m, level + offsgain);
-            gain_out_m = db2lin(adjust);
+                                                sum[c] = 0;
+                                        }
 
+                                        /* set gain_out according to the difference between
+                                           the envelope volume level (env) and the corresponding
+                                           output level (from graph) */
+#ifdef DYN_CALC_FLOAT
+                                        adjust[c] = get_table_gain(mode, 2.0f * env[c] * offsgain);
+#else
+                                        adjust[c] = get_table_gain(mode, (2.0f / F2S)
+                                                                   * (float)env[c] * offsgain);
+#endif
+                                }
+
+                                /* set gains according to stereo mode (the average
+                                   of the gains in dB is their geometric mean); the link
+                                   amount crossfades from the independent gains */
+                                switch (stereo) {
+                                case 0:
+                                        for (c = 0; c < n; c++)
+                                                gain_out[c] = adjust[c];
+                                        break;
+                                case 1:
+                                        link = adjust[0];
+                                        for (c = 1; c < n; c++)
+                                                link *= adjust[c];
+                                        link = (n == 2) ? sqrtf(link) : powf(link, 1.0f / n);
+                                        for (c = 0; c < n; c++)
+                                                adjust[c] = gain_out[c] = linkamt * link
+                                                        + (1.0f - linkamt) * adjust[c];
+                                        break;
+                                case 2:
+                                        link = adjust[0];
+                                        for (c = 1; c < n; c++)
+                                                if (adjust[c] > link)
+                                                        link = adjust[c];
+                                        for (c = 0; c < n; c++)
+                                                adjust[c] = gain_out[c] = linkamt * link
+                                                        + (1.0f - linkamt) * adjust[c];
+                                        break;
+                                }
+
+                                for (c = 0; c < n; c++)
+                                        g[c][next] = gain[c] =
+                                                gain[c] * ef_a + gain_out[c] * ef_ai;
+
+                                if (meter) {
+                                        for (c = 0; c < n; c++) {
+#ifdef DYN_CALC_FLOAT
+                                                const float e = 2.0f * env[c];
+#else
+                                                const float e = 2.0f * (float)env[c] / (float)F2S;
+#endif
+                                                if (e > ptr->meter_env_peak[c])
+                                                        ptr->meter_env_peak[c] = e;
+                                                ptr->meter_env_sq[c] += e * e;
+                                                if (gain[c] < ptr->meter_gain_min[c])
+                                                        ptr->meter_gain_min[c] = gain[c];
+                                                if (gain[c] > ptr->meter_gain_max[c])
+                                                        ptr->meter_gain_max[c] = gain[c];
+                                                ptr->meter_gain_sq[c] += gain[c] * gain[c];
+                                        }
+                                        if (++ptr->meter_count >= meter_len)
+                                                meter_send(ptr, n, frame + i + next);
+                                }
+                        }
+                }
+                count += len;
+
+                if (ms) {
+                        float * src[2];
+
+                        for (c = 0; c < 2; c++) {
+                                float * la_buf = ptr->la_buf + c * la_buflen;
+
+                                src[c] = input[c] + i;
+                                ring_write(la_buf, la_buflen, la_pos, src[c], len);
+                                if (delay) {
+                                        ring_read(la_buf, la_buflen,
+                                                  (la_pos >= delay) ? la_pos - delay
+                                                                    : la_pos + la_buflen - delay,
+                                                  dly[c], len);
+                                        src[c] = dly[c];
+                                }
+                        }
+
+                        /* gain applied to M and S, decoded back to L/R */
+                        for (j = 0; j < len; j++) {
+                                const float m = (src[0][j] + src[1][j]) * g[0][j];
+                                const float s = (src[0][j] - src[1][j]) * g[1][j];
+                                output[0][i + j] = (m + s) * 0.5f * mugain;
+                                output[1][i + j] = (m - s) * 0.5f * mugain;
+                        }
+                } else {
+                        for (c = 0; c < n; c++) {
+                                float * src = input[c] + i;
+                                float * out = output[c] + i;
+                                float * la_buf = ptr->la_buf + c * la_buflen;
+
+                                /* lookahead: the output is taken from the delay line */
+                                ring_write(la_buf, la_buflen, la_pos, src, len);
+                                if (delay) {
+                                        ring_read(la_buf, la_buflen,
+                                                  (la_pos >= delay) ? la_pos - delay
+                                                                    : la_pos + la_buflen - delay,
+                                                  dly[0], len);
+                                        src = dly[0];
+                                }
+
+                                /* gain applicator, vectorized by the compiler */
+                                for (j = 0; j < len; j++)
+                                        out[j] = src[j] * g[c][j] * mugain;
+                        }
+                }
+                la_pos += len;
+                if (la_pos >= la_buflen)
+                        la_pos -= la_buflen;
         }
-        gain_m = gain_m * ef_a + gain_out_m * ef_ai;
-        output_m[sample_index] = input_m[sample_index] * gain_m * mugain_m;
-        output_m[sample_index] = input_m[sample_index] * gain_m * mugain_m;
+
+        for (c = 0; c < n; c++) {
+                ptr->sum[c] = sum[c];
+                ptr->peak[c] = peak[c];
+                ptr->amp[c] = amp[c];
+                ptr->gain[c] = gain[c];
+                ptr->gain_out[c] = gain_out[c];
+                ptr->env[c] = env[c];
         }
-        ptr->sum_m = sum_m;
-        ptr->amp_m = amp_m;
-        ptr->gain_m = gain_m;
-        ptr->gain_out_m = gain_out_m;
-        ptr->env_m = env_m;
         ptr->count = count;
-
-    *(ptr->rmsenv_m) = LIMIT(level, -60.0f, 20.0f);
-    *(ptr->modgain_m) = LIMIT(adjust, -60.0f, 20.0f);
+        ptr->la_pos = la_pos;
 }
 
+static inline __attribute__((always_inline))
 void
-run_StereoDynamics(LV2_Handle Instance,
-         uint32_t sample_count) {
-
-    Dynamics * ptr = (Dynamics *)Instance;
-    float * input_L = ptr->input_L;
-    float * output_L = ptr->output_L;
-    float * input_R = ptr->input_R;
-    float * output_R = ptr->output_R;
-        const float attack = LIMIT(*(ptr->attack), 4.0f, 500.0f);
-        const float release = LIMIT(*(ptr->release), 4.0f, 1000.0f);
-        const float offsgain = LIMIT(*(ptr->offsgain), -20.0f, 20.0f);
-        float calcmugain = (*(ptr->mugain)+ptr->smoothmugain)*0.5;
-        ptr->smoothmugain=calcmugain;
-        const float mugain = db2lin(LIMIT(calcmugain, -20.0f, 20.0f));
-    const int stereo = LIMIT(*(ptr->stereo), 0, 2);
-    const int mode = LIMIT(*(ptr->mode), 0, NUM_MODES-1);
-    unsigned long sample_index;
-
-        dyn_t amp_L = ptr->amp_L;
-        dyn_t amp_R = ptr->amp_R;
-        dyn_t env_L = ptr->env_L;
-        dyn_t env_R = ptr->env_R;
-        float * as = ptr->as;
-        unsigned int count = ptr->count;
-        float gain_L = ptr->gain_L;
-        float gain_R = ptr->gain_R;
-        float gain_out_L = ptr->gain_out_L;
-        float gain_out_R = ptr->gain_out_R;
-        rms_env * rms_L = ptr->rms_L;
-        rms_env * rms_R = ptr->rms_R;
-        rms_t sum_L = ptr->sum_L;
-        rms_t sum_R = ptr->sum_R;
-
-        const float ga = as[(unsigned int)(attack * 0.001f * (float)(TABSIZE-1))];
-        const float gr = as[(unsigned int)(release * 0.001f * (float)(TABSIZE-1))];
-        const float ef_a = ga * 0.25f;
-        const float ef_ai = 1.0f - ef_a;
+dyn_end(Dynamics * ptr, DYN_RUN * r, const unsigned long n) {
 
-    float level_L = 0.0f;
-    float level_R = 0.0f;
-    float adjust_L = 0.0f;
-    float adjust_R = 0.0f;
-
-        for (sample_index = 0; sample_index < sample_count; sample_index++) {
+        unsigned long c;
 
+        for (c = 0; c < n; c++) {
 #ifdef DYN_CALC_FLOAT
-                sum_L += input_L[sample_index] * input_L[sample_index];
-                sum_R += input_R[sample_index] * input_R[sample_index];
-
-                if (amp_L > env_L) {
-                        env_L = env_L * ga + amp_L * (1.0f - ga);
-                } else {
-                        env_L = env_L * gr + amp_L * (1.0f - gr);
-                }
-                if (amp_R > env_R) {
-                        env_R = env_R * ga + amp_R * (1.0f - ga);
-                } else {
-                        env_R = env_R * gr + amp_R * (1.0f - gr);
-                }
+                const float e = 2.0f * ptr->env[c];
 #else
-        sum_L += (rms_t)(input_L[sample_index] * F2S) * (rms_t)(input_L[sample_index] * F2S);
-        sum_R += (rms_t)(input_R[sample_index] * F2S) * (rms_t)(input_R[sample_index] * F2S);
-
-        if (amp_L) {
-            if (amp_L > env_L) {
-                env_L = (double)env_L * ga + (double)amp_L * (1.0f - ga);
-            } else {
-                env_L = (double)env_L * gr + (double)amp_L * (1.0f - gr);
-            }
-        } else
-            env_L = 0;
-
-        if (amp_R) {
-            if (amp_R > env_R) {
-                env_R = (double)env_R * ga + (double)amp_R * (1.0f - ga);
-            } else {
-                env_R = (double)env_R * gr + (double)amp_R * (1.0f - gr);
-            }
-        } else
-            env_R = 0;
+                const float e = (2.0f / F2S) * (float)ptr->env[c];
 #endif
+                *(ptr->rmsenv[c]) = (e > 0.001f) ?
+                        LIMIT(20.0f * log10f(e), -60.0f, 20.0f) : -60.0f;
+                *(ptr->modgain[c]) = LIMIT(20.0f * log10f(r->adjust[c]), -60.0f, 20.0f);
+        }
 
-        if (count++ % 4 == 3) {
-#ifdef DYN_CALC_FLOAT
-            amp_L = rms_env_process(rms_L, sum_L * 0.25f);
-            amp_R = rms_env_process(rms_R, sum_R * 0.25f);
-#else
-            if (sum_L)
-                amp_L = rms_env_process(rms_L, sum_L * 0.25f);
-            else
-                amp_L = 0;
-
-            if (sum_R)
-                amp_R = rms_env_process(rms_R, sum_R * 0.25f);
-            else
-                amp_R = 0;
-#endif
+        if (r->meter)
+                lv2_atom_forge_pop(&ptr->forge, &r->seq);
 
+        *(ptr->latency) = r->delay;
+}
 
-#ifdef DYN_CALC_FLOAT
-            if (isnan(amp_L))
-                amp_L = 0.0f;
-            if (isnan(amp_R))
-                amp_R = 0.0f;
-#endif
-            sum_L = sum_R = 0;
+static inline __attribute__((always_inline))
+void
+run_Dynamics(Dynamics * ptr, uint32_t sample_count, const unsigned long n) {
 
-            /* set gain_out according to the difference between
-               the envelope volume level (env) and the corresponding
-               output level (from graph) */
-#ifdef DYN_CALC_FLOAT
-            level_L = 20 * log10f(2 * env_L);
-            level_R = 20 * log10f(2 * env_R);
-#else
-                        level_L = 20 * log10f(2 * (double)env_L / (double)F2S);
-                        level_R = 20 * log10f(2 * (double)env_R / (double)F2S);
-#endif
-            adjust_L = get_table_gain(mode, level_L + offsgain);
-            adjust_R = get_table_gain(mode, level_R + offsgain);
-
-            /* set gains according to stereo mode */
-            switch (stereo) {
-            case 0:
-                gain_out_L = db2lin(adjust_L);
-                gain_out_R = db2lin(adjust_R);
-                break;
-            case 1:
-                adjust_L = adjust_R = (adjust_L + adjust_R) / 2.0f;
-                gain_out_L = gain_out_R = db2lin(adjust_L);
-                break;
-            case 2:
-                adjust_L = adjust_R = (adjust_L > adjust_R) ? adjust_L : adjust_R;
-                gain_out_L = gain_out_R = db2lin(adjust_L);
-                break;
-            }
+        DYN_RUN r;
 
-        }
-        gain_L = gain_L * ef_a + gain_out_L * ef_ai;
-        gain_R = gain_R * ef_a + gain_out_R * ef_ai;
-        output_L[sample_index] = input_L[sample_index] * gain_L * mugain;
-        output_R[sample_index] = input_R[sample_index] * gain_R * mugain;
-        }
-        ptr->sum_L = sum_L;
-        ptr->sum_R = sum_R;
-        ptr->amp_L = amp_L;
-        ptr->amp_R = amp_R;
-        ptr->gain_L = gain_L;
-        ptr->gain_R = gain_R;
-        ptr->gain_out_L = gain_out_L;
-        ptr->gain_out_R = gain_out_R;
-        ptr->env_L = env_L;
-        ptr->env_R = env_R;
-        ptr->count = count;
+        dyn_begin(ptr, &r, n);
+        dyn_process(ptr, &r, sample_count, 0, n);
+        dyn_end(ptr, &r, n);
+}
 
-    *(ptr->rmsenv_L) = LIMIT(level_L, -60.0f, 20.0f);
-    *(ptr->rmsenv_R) = LIMIT(level_R, -60.0f, 20.0f);
-    *(ptr->modgain_L) = LIMIT(adjust_L, -60.0f, 20.0f);
-    *(ptr->modgain_R) = LIMIT(adjust_R, -60.0f, 20.0f);
+void
+run_MonoDynamics(LV2_Handle Instance,
+         uint32_t sample_count) {
+
+    run_Dynamics((Dynamics *)Instance, sample_count, 1);
 }
 
 void
-cleanup_MonoDynamics(LV2_Handle Instance) {
+run_StereoDynamics(LV2_Handle Instance,
+         uint32_t sample_count) {
 
-    Dynamics * ptr = (Dynamics *)Instance;
+    run_Dynamics((Dynamics *)Instance, sample_count, 2);
+}
 
-    free(ptr->rms_m);
-    free(ptr->as);
-    free(Instance);
+void
+run_QuadDynamics(LV2_Handle Instance,
+         uint32_t sample_count) {
+
+    run_Dynamics((Dynamics *)Instance, sample_count, 4);
+}
+
+void
+run_SurroundDynamics(LV2_Handle Instance,
+         uint32_t sample_count) {
+
+    run_Dynamics((Dynamics *)Instance, sample_count, 6);
 }
 
 /* Throw away a Dynamics effect instance. */
 void
-cleanup_StereoDynamics(LV2_Handle Instance) {
+cleanup_Dynamics(LV2_Handle Instance) {
 
     Dynamics * ptr = (Dynamics *)Instance;
 
-    free(ptr->rms_L);
-    free(ptr->rms_R);
-    free(ptr->as);
+    free(ptr->rms_buf);
+    free(ptr->la_buf);
+    as_table_put(ptr->as);
     free(Instance);
 }
 
@@ -794,15 +1229,279 @@ extension_data_Dynamics(const char* uri)
     return NULL;
 }
 
+
+
+/* Multiband (stereo) dynamics: the input is split into MB_BANDS bands
+   by Linkwitz-Riley crossovers, and each band goes through a stereo
+   Dynamics instance of its own, with the band's function and makeup
+   gain.  The bands are processed in place, DYN_BLOCK samples at a
+   time, and summed to the output. */
+
+#define MB_BANDS        4
+
+/* The port numbers for the multiband plugin: */
+
+#define MB_ATTACK       0
+#define MB_RELEASE      1
+#define MB_OFFSGAIN     2
+#define MB_STEREO       3
+#define MB_XOVER(x)     (4 + (x))
+#define MB_MODE(b)      (4 + MB_BANDS - 1 + (b))
+#define MB_MUGAIN(b)    (MB_MODE(b) + MB_BANDS)
+#define MB_MODGAIN(b)   (MB_MUGAIN(b) + MB_BANDS)
+#define MB_INPUT(c)     (MB_MODGAIN(MB_BANDS) + (c))
+#define MB_OUTPUT(c)    (MB_INPUT(2) + (c))
+
+/* Total number of ports */
+
+#define MB_PORTCOUNT    MB_OUTPUT(2)
+
+/* bandwidth [octaves] giving Butterworth (Q = 1/sqrt(2)) sections at
+   low frequencies, scaled by sin(w)/w for the lp/hp_set_params()
+   bandwidth warping; two of them in a row make a LR4 crossover */
+#define BUTTERWORTH_BW  1.89997f
+
+/* crossover frequency ranges [Hz] */
+static const float xover_min[MB_BANDS - 1] = { 40.0f, 400.0f, 4000.0f };
+static const float xover_max[MB_BANDS - 1] = { 400.0f, 4000.0f, 16000.0f };
+
+
+typedef struct {
+    float * modgain[MB_BANDS];
+    float * xover[MB_BANDS - 1];
+    float * input[2];
+    float * output[2];
+    double sample_rate;
+
+    Dynamics * band[MB_BANDS];
+    float band_buf[MB_BANDS][2][DYN_BLOCK];
+
+    /* crossover x: two low and two high pass sections per channel,
+       and for each band b below it an allpass, ap[b][x], to keep the
+       phase of that band in line with the bands above */
+    biquad lp[MB_BANDS - 1][2][2];
+    biquad hp[MB_BANDS - 1][2][2];
+    biquad ap[MB_BANDS - 1][MB_BANDS - 1][2];
+    float old_xover[MB_BANDS - 1];
+
+    /* what the ports of the band instances not exposed are set to */
+    float zero;
+    float rmswin;
+    float sc_hpf;
+    float sc_lpf;
+    float linkamt;
+    float dummy;
+    float rmsenv[MB_BANDS][2];
+    float band_modgain[MB_BANDS][2];
+
+} MBDynamics;
+
+
+LV2_Handle
+instantiate_MBDynamics(const LV2_Descriptor * Descriptor, double sample_rate, const char* bundle_path, const LV2_Feature* const* features) {
+
+    MBDynamics * ptr;
+    Dynamics * band;
+    int b, c;
+
+    if ((ptr = calloc(1, sizeof(MBDynamics))) == NULL)
+        return NULL;
+
+    ptr->sample_rate = sample_rate;
+    ptr->rmswin = 5.8f;
+    ptr->sc_hpf = SC_HPF_MIN;
+    ptr->sc_lpf = SC_LPF_MAX;
+    ptr->linkamt = 100.0f;
+
+    for (b = 0; b < MB_BANDS; b++) {
+        if ((band = ptr->band[b] = instantiate_Dynamics(sample_rate, 2, NULL)) == NULL) {
+            while (b--)
+                cleanup_Dynamics(ptr->band[b]);
+            free(ptr);
+            return NULL;
+        }
+        for (c = 0; c < 2; c++) {
+            band->rmsenv[c] = &ptr->rmsenv[b][c];
+            band->modgain[c] = &ptr->band_modgain[b][c];
+            band->input[c] = band->output[c] = ptr->band_buf[b][c];
+        }
+        band->lookahead = &ptr->zero;
+        band->latency = &ptr->dummy;
+        band->detector = &ptr->zero;
+        band->rmswin = &ptr->rmswin;
+        band->sc_source = &ptr->zero;
+        band->sc_hpf = &ptr->sc_hpf;
+        band->sc_lpf = &ptr->sc_lpf;
+        band->linkamt = &ptr->linkamt;
+        band->midside = &ptr->zero;
+    }
+
+    return (LV2_Handle)ptr;
+}
+
+void
+activate_MBDynamics(LV2_Handle Instance) {
+
+    MBDynamics * ptr = (MBDynamics *)Instance;
+    int b, x, c;
+
+    for (b = 0; b < MB_BANDS; b++)
+        activate_Dynamics(ptr->band[b]);
+
+    for (x = 0; x < MB_BANDS - 1; x++) {
+        for (c = 0; c < 2; c++) {
+            biquad_init(&ptr->lp[x][c][0]);
+            biquad_init(&ptr->lp[x][c][1]);
+            biquad_init(&ptr->hp[x][c][0]);
+            biquad_init(&ptr->hp[x][c][1]);
+            for (b = 0; b < x; b++)
+                biquad_init(&ptr->ap[b][x][c]);
+        }
+        ptr->old_xover[x] = 0.0f;
+    }
+}
+
+void
+connect_port_MBDynamics(LV2_Handle Instance,
+             uint32_t Port,
+             void * DataLocation) {
+
+    MBDynamics * ptr = (MBDynamics *)Instance;
+    int b;
+
+    /* the controls shared by the bands go straight to their instances */
+    for (b = 0; b < MB_BANDS; b++) {
+        switch (Port) {
+        case MB_ATTACK:
+            ptr->band[b]->attack = (float*) DataLocation;
+            break;
+        case MB_RELEASE:
+            ptr->band[b]->release = (float*) DataLocation;
+            break;
+        case MB_OFFSGAIN:
+            ptr->band[b]->offsgain = (float*) DataLocation;
+            break;
+        case MB_STEREO:
+            ptr->band[b]->stereo = (float*) DataLocation;
+            break;
+        }
+    }
+
+    if (Port >= MB_XOVER(0) && Port < MB_XOVER(MB_BANDS - 1))
+        ptr->xover[Port - MB_XOVER(0)] = (float*) DataLocation;
+    else if (Port >= MB_MODE(0) && Port < MB_MODE(MB_BANDS))
+        ptr->band[Port - MB_MODE(0)]->mode = (float*) DataLocation;
+    else if (Port >= MB_MUGAIN(0) && Port < MB_MUGAIN(MB_BANDS))
+        ptr->band[Port - MB_MUGAIN(0)]->mugain = (float*) DataLocation;
+    else if (Port >= MB_MODGAIN(0) && Port < MB_MODGAIN(MB_BANDS))
+        ptr->modgain[Port - MB_MODGAIN(0)] = (float*) DataLocation;
+    else if (Port >= MB_INPUT(0) && Port < MB_INPUT(2))
+        ptr->input[Port - MB_INPUT(0)] = (float*) DataLocation;
+    else if (Port >= MB_OUTPUT(0) && Port < MB_OUTPUT(2))
+        ptr->output[Port - MB_OUTPUT(0)] = (float*) DataLocation;
+}
+
+void
+run_MBDynamics(LV2_Handle Instance,
+         uint32_t sample_count) {
+
+    MBDynamics * ptr = (MBDynamics *)Instance;
+    float (* band_buf)[2][DYN_BLOCK] = ptr->band_buf;
+    DYN_RUN run[MB_BANDS];
+    float fc, w, bw;
+    float x, lo, hi;
+    unsigned long i, j, len;
+    int b, c, k;
+
+    /* crossovers, clamped to their ranges so they stay in order */
+    for (k = 0; k < MB_BANDS - 1; k++) {
+        fc = LIMIT(*(ptr->xover[k]), xover_min[k], xover_max[k]);
+        if (fc > 0.45f * ptr->sample_rate)
+            fc = 0.45f * ptr->sample_rate;
+        if (fc != ptr->old_xover[k]) {
+            w = 2.0f * M_PI * fc / ptr->sample_rate;
+            bw = BUTTERWORTH_BW * sinf(w) / w;
+            for (c = 0; c < 2; c++) {
+                lp_set_params(&ptr->lp[k][c][0], fc, bw, ptr->sample_rate);
+                lp_set_params(&ptr->lp[k][c][1], fc, bw, ptr->sample_rate);
+                hp_set_params(&ptr->hp[k][c][0], fc, bw, ptr->sample_rate);
+                hp_set_params(&ptr->hp[k][c][1], fc, bw, ptr->sample_rate);
+                for (b = 0; b < k; b++)
+                    ap_set_params(&ptr->ap[b][k][c], fc, bw, ptr->sample_rate);
+            }
+            ptr->old_xover[k] = fc;
+        }
+    }
+
+    /* the bands are fed in pieces of DYN_BLOCK, their settings are
+       read once for the whole block */
+    for (b = 0; b < MB_BANDS; b++)
+        dyn_begin(ptr->band[b], run + b, 2);
+
+    for (i = 0; i < sample_count; i += len) {
+        len = sample_count - i;
+        if (len > DYN_BLOCK)
+            len = DYN_BLOCK;
+
+        /* split: band b is the low pass of what is above crossover
+           b-1, then sent through the allpasses of the crossovers above
+           it, which the higher bands have gone through as well */
+        for (c = 0; c < 2; c++) {
+            for (j = 0; j < len; j++) {
+                x = ptr->input[c][i + j];
+                for (k = 0; k < MB_BANDS - 1; k++) {
+                    lo = biquad_run(&ptr->lp[k][c][1], biquad_run(&ptr->lp[k][c][0], x));
+                    for (b = k + 1; b < MB_BANDS - 1; b++)
+                        lo = biquad_run(&ptr->ap[k][b][c], lo);
+                    band_buf[k][c][j] = lo;
+                    hi = biquad_run(&ptr->hp[k][c][1], biquad_run(&ptr->hp[k][c][0], x));
+                    x = hi;
+                }
+                band_buf[MB_BANDS - 1][c][j] = x;
+            }
+        }
+
+        for (b = 0; b < MB_BANDS; b++)
+            dyn_process(ptr->band[b], run + b, len, i, 2);
+
+        for (c = 0; c < 2; c++) {
+            float * out = ptr->output[c] + i;
+
+            memcpy(out, band_buf[0][c], len * sizeof(float));
+            for (b = 1; b < MB_BANDS; b++)
+                for (j = 0; j < len; j++)
+                    out[j] += band_buf[b][c][j];
+        }
+    }
+
+    for (b = 0; b < MB_BANDS; b++)
+        dyn_end(ptr->band[b], run + b, 2);
+
+    for (b = 0; b < MB_BANDS; b++)
+        *(ptr->modgain[b]) = (ptr->band_modgain[b][0] < ptr->band_modgain[b][1]) ?
+            ptr->band_modgain[b][0] : ptr->band_modgain[b][1];
+}
+
+void
+cleanup_MBDynamics(LV2_Handle Instance) {
+
+    MBDynamics * ptr = (MBDynamics *)Instance;
+    int b;
+
+    for (b = 0; b < MB_BANDS; b++)
+        cleanup_Dynamics(ptr->band[b]);
+    free(Instance);
+}
+
 static const
 LV2_Descriptor MonoDescriptor = {
     "http://moddevices.com/plugins/tap/dynamics",
     instantiate_MonoDynamics,
-    connect_port_MonoDynamics,
+    connect_port_Dynamics,
     activate_Dynamics,
     run_MonoDynamics,
     deactivate_Dynamics,
-    cleanup_MonoDynamics,
+    cleanup_Dynamics,
     extension_data_Dynamics
 };
 
@@ -810,11 +1509,47 @@ static const
 LV2_Descriptor StereoDescriptor = {
     "http://moddevices.com/plugins/tap/dynamics-st",
     instantiate_StereoDynamics,
-    connect_port_StereoDynamics,
+    connect_port_Dynamics,
     activate_Dynamics,
     run_StereoDynamics,
     deactivate_Dynamics,
-    cleanup_StereoDynamics,
+    cleanup_Dynamics,
+    extension_data_Dynamics
+};
+
+static const
+LV2_Descriptor QuadDescriptor = {
+    "http://moddevices.com/plugins/tap/dynamics-quad",
+    instantiate_QuadDynamics,
+    connect_port_Dynamics,
+    activate_Dynamics,
+    run_QuadDynamics,
+    deactivate_Dynamics,
+    cleanup_Dynamics,
+    extension_data_Dynamics
+};
+
+static const
+LV2_Descriptor SurroundDescriptor = {
+    "http://moddevices.com/plugins/tap/dynamics-51",
+    instantiate_SurroundDynamics,
+    connect_port_Dynamics,
+    activate_Dynamics,
+    run_SurroundDynamics,
+    deactivate_Dynamics,
+    cleanup_Dynamics,
+    extension_data_Dynamics
+};
+
+static const
+LV2_Descriptor MBDescriptor = {
+    "http://moddevices.com/plugins/tap/dynamics-mb",
+    instantiate_MBDynamics,
+    connect_port_MBDynamics,
+    activate_MBDynamics,
+    run_MBDynamics,
+    deactivate_Dynamics,
+    cleanup_MBDynamics,
     extension_data_Dynamics
 };
 
@@ -827,6 +1562,12 @@ lv2_descriptor(uint32_t index)
         return &MonoDescriptor;
     case 1:
         return &StereoDescriptor;
+    case 2:
+        return &QuadDescriptor;
+    case 3:
+        return &SurroundDescriptor;
+    case 4:
+        return &MBDescriptor;
     default:
         return NULL;
     }
@@ -0,0 +1,104 @@
+/*                                                     -*- linux-c -*-
+    Copyright (C) 2004 Tom Szilagyi
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+
+/* Build time generator of tap_dynamics_tables.h: the in/out dB graph
+ * of every preset in tap_dynamics_presets.h, sampled at the linear input
+ * levels the plugin indexes by exponent and mantissa, and turned into
+ * linear gains, so that the plugin only has to look them up.  Run on the
+ * build machine, it writes the header to stdout.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include "tap_dynamics_presets.h"
+
+
+/* gain (in dB) to apply at input level, interpolated from the graph */
+static float
+graph_gain(int mode, float level) {
+
+    float x1 = -80.0f;
+    float y1 = -80.0f;
+    float x2 = 0.0f;
+    float y2 = 0.0f;
+    int i = 0;
+
+    if (level <= -80.0f)
+        return graph_gain(mode, -79.9f);
+
+    while (i < dyn_data[mode].num_points && dyn_data[mode].points[i].x < level) {
+        x1 = dyn_data[mode].points[i].x;
+        y1 = dyn_data[mode].points[i].y;
+        i++;
+    }
+    if (i < dyn_data[mode].num_points) {
+        x2 = dyn_data[mode].points[i].x;
+        y2 = dyn_data[mode].points[i].y;
+    } else
+        return 0.0f;
+
+    return y1 + ((level - x1) * (y2 - y1) / (x2 - x1)) - level;
+}
+
+
+/* print a float literal which reads back exactly */
+static void
+print_float(float v) {
+
+    char buf[32];
+
+    snprintf(buf, sizeof(buf), "%.9g", v);
+    printf("%s%sf", buf, strpbrk(buf, ".e") ? "" : ".0");
+}
+
+
+/* input level (dB) of table entry i: GAIN_TAB_STEPS linear steps
+   per octave, the first octave starting at 2^(GAIN_TAB_EMIN-1) */
+static float
+entry_level(int i) {
+
+    int octave = i / GAIN_TAB_STEPS;
+    double m = 0.5 + 0.5 * (i % GAIN_TAB_STEPS) / GAIN_TAB_STEPS;
+
+    return 20.0 * log10(ldexp(m, GAIN_TAB_EMIN + octave));
+}
+
+
+int
+main(void) {
+
+    int m, i;
+
+    printf("/* Generated by tap_dynamics_gen from tap_dynamics_presets.h, do not edit. */\n\n");
+
+    printf("static const float gain_table[NUM_MODES][GAIN_TAB_SIZE] = {\n");
+    for (m = 0; m < NUM_MODES; m++) {
+        printf("\t{");
+        for (i = 0; i < GAIN_TAB_SIZE; i++) {
+            printf("%s", i == 0 ? "" : i % 8 ? ", " : ",\n\t ");
+            print_float(powf(10.0f, graph_gain(m, entry_level(i)) * 0.05f));
+        }
+        printf("},\n");
+    }
+    printf("};\n");
+
+    return 0;
+}
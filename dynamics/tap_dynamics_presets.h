@@ -19,6 +19,32 @@
 */
 
 
+/* max. number of breakpoints on in/out dB graph */
+#define MAX_POINTS 20
+
+typedef struct {
+    float x;
+    float y;
+} GRAPH_POINT;
+
+typedef struct {
+    unsigned long num_points;
+    GRAPH_POINT points[MAX_POINTS];
+} DYNAMICS_DATA;
+
+
+/* The graphs are turned into tables of linear gains (see
+ * tap_dynamics_gen.c), indexed by the linear input level: the octave
+ * comes from its exponent, the position within the octave from its
+ * mantissa, GAIN_TAB_STEPS entries apart.  The tables cover levels from
+ * 2^(GAIN_TAB_EMIN-1) to 2^GAIN_TAB_EMAX (about -84 to +24 dB); outside
+ * that range the gain of the nearest end applies. */
+#define GAIN_TAB_EMIN  -13
+#define GAIN_TAB_EMAX  4
+#define GAIN_TAB_STEPS 64
+#define GAIN_TAB_SIZE  ((GAIN_TAB_EMAX - GAIN_TAB_EMIN + 1) * GAIN_TAB_STEPS + 1)
+
+
 /* Number of dynamics presets */
 #define NUM_MODES 15
 
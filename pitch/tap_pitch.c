@@ -58,6 +58,11 @@
 /* frequency of the modulation signal (Hz) */
 #define PM_FREQ 6.0f
 
+/* interpolation of the three modulated taps */
+#ifndef PM_INTERP
+#define PM_INTERP FDELAY_HERMITE
+#endif
+
 
 #define COS_TABLE_SIZE 1024
 float cos_table[COS_TABLE_SIZE];
@@ -79,9 +84,8 @@ typedef struct {
     float * input;
     float * output;
 
-    float * ringbuffer;
-    unsigned long buflen;
-    unsigned long pos;
+    fdelay line;
+    float interp_state[4];
     float phase;
 
     unsigned long sample_rate;
@@ -109,11 +113,11 @@ instantiate_Pitch(const LV2_Descriptor * Descriptor, double SampleRate, const ch
     if ((ptr = malloc(sizeof(Pitch))) != NULL) {
         ((Pitch *)ptr)->sample_rate = SampleRate;
         ((Pitch *)ptr)->run_adding_gain = 1.0f;
-        if ((((Pitch *)ptr)->ringbuffer =
-             calloc(2 * PM_BUFLEN, sizeof(float))) == NULL)
+        float * buffer;
+
+        if ((buffer = calloc(2 * PM_BUFLEN + FDELAY_GUARD, sizeof(float))) == NULL)
             return NULL;
-        ((Pitch *)ptr)->buflen = 2 * PM_BUFLEN * SampleRate / 192000;
-        ((Pitch *)ptr)->pos = 0;
+        fdelay_init(&((Pitch *)ptr)->line, buffer, 2 * PM_BUFLEN * SampleRate / 192000);
         return ptr;
     }
         return NULL;
@@ -124,10 +128,11 @@ void
 activate_Pitch(LV2_Handle Instance) {
 
     Pitch * ptr = (Pitch *)Instance;
-    unsigned long i;
+    int i;
 
-    for (i = 0; i < ptr->buflen; i++)
-        ptr->ringbuffer[i] = 0.0f;
+    fdelay_clear(&ptr->line);
+    for (i = 0; i < 4; i++)
+        ptr->interp_state[i] = 0.0f;
 
     ptr->phase = 0.0f;
 }
@@ -181,7 +186,7 @@ run_Pitch(LV2_Handle Instance,
     float * output = ptr->output;
     float drylevel = db2lin(LIMIT(*(ptr->drylevel),-90.0f,20.0f));
     float wetlevel = 0.333333f * db2lin(LIMIT(*(ptr->wetlevel),-90.0f,20.0f));
-    float buflen = ptr->buflen / 2.0f;
+    float buflen = ptr->line.buflen / 2.0f;
     float semitone = LIMIT(*(ptr->semitone),-12.0f,12.0f);
     float rate;
     float r;
@@ -198,10 +203,9 @@ run_Pitch(LV2_Handle Instance,
     float phase_am_1 = 0.0f;
     float phase_2 = 0.0f;
     float phase_am_2 = 0.0f;
-    float fpos_0 = 0.0f, fpos_1 = 0.0f, fpos_2 = 0.0f;
-    float n_0 = 0.0f, n_1 = 0.0f, n_2 = 0.0f;
-    float rem_0 = 0.0f, rem_1 = 0.0f, rem_2 = 0.0f;
-    float sa_0, sb_0, sa_1, sb_1, sa_2, sb_2;
+    const fdelay * const lines[4] = { &ptr->line, &ptr->line, &ptr->line, &ptr->line };
+    float fpos[4];
+    v4sf pm;
 
 
     if (semitone == 0.0f)
@@ -241,39 +245,21 @@ run_Pitch(LV2_Handle Instance,
         while (phase_am_2 >= COS_TABLE_SIZE)
             phase_am_2 -= COS_TABLE_SIZE;
 
-        push_buffer(in, ptr->ringbuffer, ptr->buflen, &(ptr->pos));
-
-        fpos_0 = depth * (1.0f - sign * (2.0f * phase_0 / COS_TABLE_SIZE - 1.0f));
-        n_0 = floorf(fpos_0);
-        rem_0 = fpos_0 - n_0;
-
-        fpos_1 = depth * (1.0f - sign * (2.0f * phase_1 / COS_TABLE_SIZE - 1.0f));
-        n_1 = floorf(fpos_1);
-        rem_1 = fpos_1 - n_1;
-
-        fpos_2 = depth * (1.0f - sign * (2.0f * phase_2 / COS_TABLE_SIZE - 1.0f));
-        n_2 = floorf(fpos_2);
-        rem_2 = fpos_2 - n_2;
-
-        sa_0 = read_buffer(ptr->ringbuffer, ptr->buflen, ptr->pos, (unsigned long) n_0);
-        sb_0 = read_buffer(ptr->ringbuffer, ptr->buflen, ptr->pos, (unsigned long) n_0 + 1);
-
-        sa_1 = read_buffer(ptr->ringbuffer, ptr->buflen, ptr->pos, (unsigned long) n_1);
-        sb_1 = read_buffer(ptr->ringbuffer, ptr->buflen, ptr->pos, (unsigned long) n_1 + 1);
+        fdelay_push(&ptr->line, in);
 
-        sa_2 = read_buffer(ptr->ringbuffer, ptr->buflen, ptr->pos, (unsigned long) n_2);
-        sb_2 = read_buffer(ptr->ringbuffer, ptr->buflen, ptr->pos, (unsigned long) n_2 + 1);
+        /* the fourth lane is spare, the dry signal is read on a sample */
+        fpos[0] = depth * (1.0f - sign * (2.0f * phase_0 / COS_TABLE_SIZE - 1.0f));
+        fpos[1] = depth * (1.0f - sign * (2.0f * phase_1 / COS_TABLE_SIZE - 1.0f));
+        fpos[2] = depth * (1.0f - sign * (2.0f * phase_2 / COS_TABLE_SIZE - 1.0f));
+        fpos[3] = fpos[0];
+        pm = fdelay_read_frac4(lines, fpos, PM_INTERP, ptr->interp_state);
 
         *(output++) =
             wetlevel *
-            ((1.0f + cos_table[(unsigned long) phase_am_0]) *
-             ((1 - rem_0) * sa_0 + rem_0 * sb_0) +
-             (1.0f + cos_table[(unsigned long) phase_am_1]) *
-             ((1 - rem_1) * sa_1 + rem_1 * sb_1) +
-             (1.0f + cos_table[(unsigned long) phase_am_2]) *
-             ((1 - rem_2) * sa_2 + rem_2 * sb_2)) +
-            drylevel *
-            read_buffer(ptr->ringbuffer, ptr->buflen, ptr->pos, (unsigned long) depth);
+            ((1.0f + cos_table[(unsigned long) phase_am_0]) * pm[0] +
+             (1.0f + cos_table[(unsigned long) phase_am_1]) * pm[1] +
+             (1.0f + cos_table[(unsigned long) phase_am_2]) * pm[2]) +
+            drylevel * fdelay_read(&ptr->line, (unsigned long) depth);
 
     }
 
@@ -290,7 +276,7 @@ void
 cleanup_Pitch(LV2_Handle Instance) {
 
     Pitch * ptr = (Pitch *)Instance;
-    free(ptr->ringbuffer);
+    free(ptr->line.buffer);
     free(Instance);
 }
 
@@ -23,40 +23,67 @@
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
+#include <sched.h>
+#include <unistd.h>
 #include <lv2.h>
+#include <lv2/lv2plug.in/ns/ext/worker/worker.h>
 
 
 /* ***** VERY IMPORTANT! *****
  *
- * If you enable this, the plugin will use float arithmetics in DSP
- * calculations.  This usually yields lower average CPU usage, but
+ * The DSP code is built three times, as three kernels differing in the
+ * arithmetics used in the filters:
+ *
+ *   fixed  - fixpoint (this file, the default)
+ *   float  - single precision float (tap_reverb_float.c)
+ *   double - double precision float (tap_reverb_double.c)
+ *
+ * Float arithmetics usually yields lower average CPU usage, but
  * occasionaly may result in high CPU peaks which cause trouble to you
- * and your JACK server.  The default is to use fixpoint arithmetics
- * (with the following #define commented out).  But (depending on the
- * processor on which you run the code) you may find floating point
- * mode usable.
+ * and your JACK server.  Which one is best depends on the processor on
+ * which you run the code, so the kernel is chosen for each instance by
+ * the TAP_REVERB_KERNEL environment variable ("fixed", "float" or
+ * "double"), see instantiate_dispatch().
  */
-/* #define REVERB_CALC_FLOAT */
-
-
 
-#ifndef REVERB_CALC_FLOAT
+#if defined(REVERB_CALC_FLOAT)
+typedef float rev_t;
+#define REVERB_KERNEL reverb_kernel_float
+#elif defined(REVERB_CALC_DOUBLE)
+typedef double rev_t;
+#define REVERB_KERNEL reverb_kernel_double
+#else
 typedef signed int sample;
+typedef sample rev_t;
+#define REVERB_KERNEL reverb_kernel_fixed
 #endif
 
-#ifndef REVERB_CALC_FLOAT
-typedef sample rev_t;
-#else
-typedef float rev_t;
+#if defined(REVERB_CALC_FLOAT) || defined(REVERB_CALC_DOUBLE)
+#define REVERB_CALC_FP
 #endif
 
 
 #include "tap_reverb_presets.h"
+#ifndef REVERB_CALC_FP
+#include "tap_reverb_tables.h"
+#else
+extern const PRESET_TABLE preset_tables[];
+#endif
 
 
 
-#ifdef REVERB_CALC_FLOAT
-#define DENORM(x) (((unsigned char)(((*(unsigned int*)&(x))&0x7f800000)>>23))<103)?0.0f:(x)
+#ifdef REVERB_BENCH
+/* tap_reverb_bench can keep the filters running on a silent tail */
+extern int reverb_bench_no_idle;
+#define IDLE_ALLOWED (!reverb_bench_no_idle)
+#else
+#define IDLE_ALLOWED 1
+#endif
+
+
+#ifdef REVERB_CALC_FP
+/* flush samples below 2^-24 (about -144 dB) to zero */
+#define DENORM(x) (((x) < 0x1p-24 && (x) > -0x1p-24) ? 0 : (x))
 #else
 /* coefficient for float to sample (signed int) conversion */
 /* this allows for about 60 dB headroom above 0dB, if 0 dB is equivalent to 1.0f */
@@ -65,298 +92,570 @@ typedef float rev_t;
 #endif
 
 
-/* load plugin data from reverb_data[] into an instance */
-void
-load_plugin_data(LV2_Handle Instance) {
+/* carve size bytes from the arena starting at *top */
+static void *
+arena_carve(char ** top, size_t size) {
+
+    void * p = *top;
+
+    *top += ARENA_SIZE(size);
+    return p;
+}
+
+
+/* load the precomputed coefficients of a preset into a tank, and lay out
+ * its delay lines in the tank's pool */
+static void
+load_plugin_data(Reverb * ptr, TANK * tank, float mode) {
 
-    Reverb * ptr = (Reverb *)Instance;
     unsigned long m;
-    int i;
+    int i, c;
+    const PRESET_COEFFS * pc;
+    const REVERB_DATA * rd;
+    biquad filter;
+    char * top = (char *)tank->ringbuffers;
 
 
-    m = LIMIT(*(ptr->mode),0,NUM_MODES-1);
+    m = LIMIT(mode,0,NUM_MODES-1);
+    pc = ptr->coeffs + m;
+    rd = reverb_data + m;
+    tank->mode = mode;
+    tank->coeffs = pc;
 
     /* load combs data */
-    ptr->num_combs = 2 * reverb_data[m].num_combs;
-    for (i = 0; i < reverb_data[m].num_combs; i++) {
-        ((COMB_FILTER *)(ptr->combs + 2*i))->buflen =
-            reverb_data[m].combs[i].delay * ptr->sample_rate;
-        ((COMB_FILTER *)(ptr->combs + 2*i))->feedback =
-            reverb_data[m].combs[i].feedback;
-        ((COMB_FILTER *)(ptr->combs + 2*i))->freq_resp =
-            LIMIT(reverb_data[m].combs[i].freq_resp
-                  * powf(ptr->sample_rate / 44100.0f, 0.8f),
-                  0.0f, 1.0f);
-
-        ((COMB_FILTER *)(ptr->combs + 2*i+1))->buflen =
-            ((COMB_FILTER *)(ptr->combs + 2*i))->buflen;
-        ((COMB_FILTER *)(ptr->combs + 2*i+1))->feedback =
-            ((COMB_FILTER *)(ptr->combs + 2*i))->feedback;
-        ((COMB_FILTER *)(ptr->combs + 2*i+1))->feedback =
-            ((COMB_FILTER *)(ptr->combs + 2*i))->freq_resp;
+    tank->num_combs = 2 * reverb_data[m].num_combs;
+    for (c = 0; c < 2; c++) {
+        COMB_BANK * bank = &tank->ch[c].combs;
+
+        bank->num_combs = reverb_data[m].num_combs;
+        for (i = 0; i < COMB_SLOTS; i++) {
+            if (i < reverb_data[m].num_combs) {
+                bank->ringbuffer[i] = arena_carve(&top, sizeof(rev_t) *
+                    DELAY_LINE_LEN(rd->combs[i].delay, ptr->sample_rate));
+                bank->buflen[i] = pc->comb_buflen[i];
+                filter.b0 = pc->comb_lp[i][0];
+                filter.b1 = 2.0f * pc->comb_lp[i][0];
+                filter.b2 = pc->comb_lp[i][0];
+                filter.a1 = pc->comb_lp[i][1];
+                filter.a2 = pc->comb_lp[i][2];
+            } else {
+                /* unused lanes run silently with zero gain */
+                bank->ringbuffer[i] = NULL;
+                bank->buflen[i] = 1;
+                LANE(bank->fb_gain, i) = 0.0f;
+                LANE(bank->fb_gain_step, i) = 0.0f;
+                filter.b0 = filter.b1 = filter.b2 = 0.0f;
+                filter.a1 = filter.a2 = 0.0f;
+            }
+            comb_bank_set_filter(bank, i, &filter);
 
-        /* set initial values: */
-        *(((COMB_FILTER *)(ptr->combs + 2*i))->buffer_pos) = 0;
-        *(((COMB_FILTER *)(ptr->combs + 2*i+1))->buffer_pos) = 0;
-        ((COMB_FILTER *)(ptr->combs + 2*i))->last_out = 0;
-        ((COMB_FILTER *)(ptr->combs + 2*i+1))->last_out = 0;
-
-        lp_set_params(((COMB_FILTER *)(ptr->combs + 2*i))->filter,
-                  2000.0f + 13000.0f * (1 - reverb_data[m].combs[i].freq_resp)
-                  * ptr->sample_rate / 44100.0f,
-                  BANDPASS_BWIDTH, ptr->sample_rate);
-        lp_set_params(((COMB_FILTER *)(ptr->combs + 2*i+1))->filter,
-                  2000.0f + 13000.0f * (1 - reverb_data[m].combs[i].freq_resp)
-                  * ptr->sample_rate / 44100.0f,
-                  BANDPASS_BWIDTH, ptr->sample_rate);
+            /* set initial values: */
+            bank->buffer_pos[i] = 0;
+            LANE(bank->last_out, i) = 0;
+        }
+
+        for (i = 0; i < reverb_data[m].num_allps; i++)
+            tank->ch[c].allps[i].ringbuffer = arena_carve(&top, sizeof(rev_t) *
+                DELAY_LINE_LEN(rd->allps[i].delay, ptr->sample_rate));
     }
+    tank->ringbuffers_size = top - (char *)tank->ringbuffers;
 
     /* load allps data */
-    ptr->num_allps = 2 * reverb_data[m].num_allps;
+    tank->num_allps = 2 * reverb_data[m].num_allps;
+    tank->tail_delay = 0;
+    for (i = 0; i < reverb_data[m].num_combs; i++)
+        if (pc->comb_buflen[i] > tank->tail_delay)
+            tank->tail_delay = pc->comb_buflen[i];
     for (i = 0; i < reverb_data[m].num_allps; i++) {
-        ((ALLP_FILTER *)(ptr->allps + 2*i))->buflen =
-            reverb_data[m].allps[i].delay * ptr->sample_rate;
-        ((ALLP_FILTER *)(ptr->allps + 2*i))->feedback =
-            reverb_data[m].allps[i].feedback;
+        tank->tail_delay += pc->allp_buflen[i];
+        tank->ch[0].allps[i].buflen = pc->allp_buflen[i];
+        tank->ch[0].allps[i].feedback = reverb_data[m].allps[i].feedback;
 
-        ((ALLP_FILTER *)(ptr->allps + 2*i+1))->buflen =
-            ((ALLP_FILTER *)(ptr->allps + 2*i))->buflen;
-        ((ALLP_FILTER *)(ptr->allps + 2*i+1))->feedback =
-            ((ALLP_FILTER *)(ptr->allps + 2*i))->feedback;
+        tank->ch[1].allps[i].buflen = tank->ch[0].allps[i].buflen;
+        tank->ch[1].allps[i].feedback = tank->ch[0].allps[i].feedback;
 
         /* set initial values: */
-        *(((ALLP_FILTER *)(ptr->allps + 2*i))->buffer_pos) = 0;
-        *(((ALLP_FILTER *)(ptr->allps + 2*i+1))->buffer_pos) = 0;
-        ((ALLP_FILTER *)(ptr->allps + 2*i))->last_out = 0;
-        ((ALLP_FILTER *)(ptr->allps + 2*i+1))->last_out = 0;
+        *(tank->ch[0].allps[i].buffer_pos) = 0;
+        *(tank->ch[1].allps[i].buffer_pos) = 0;
+        tank->ch[0].allps[i].last_out = 0;
+        tank->ch[1].allps[i].last_out = 0;
     }
 
     /* init bandpass filters */
-    lp_set_params((biquad *)(ptr->low_pass), reverb_data[m].bandpass_high,
-              BANDPASS_BWIDTH, ptr->sample_rate);
-    hp_set_params((biquad *)(ptr->high_pass), reverb_data[m].bandpass_low,
-              BANDPASS_BWIDTH, ptr->sample_rate);
-    lp_set_params((biquad *)(ptr->low_pass + 1), reverb_data[m].bandpass_high,
-              BANDPASS_BWIDTH, ptr->sample_rate);
-    hp_set_params((biquad *)(ptr->high_pass + 1), reverb_data[m].bandpass_low,
-              BANDPASS_BWIDTH, ptr->sample_rate);
+    for (c = 0; c < 2; c++) {
+        tank->ch[c].low_pass.b0 = pc->low_pass[0];
+        tank->ch[c].low_pass.b1 = pc->low_pass[1];
+        tank->ch[c].low_pass.b2 = pc->low_pass[2];
+        tank->ch[c].low_pass.a1 = pc->low_pass[3];
+        tank->ch[c].low_pass.a2 = pc->low_pass[4];
+        tank->ch[c].high_pass.b0 = pc->high_pass[0];
+        tank->ch[c].high_pass.b1 = pc->high_pass[1];
+        tank->ch[c].high_pass.b2 = pc->high_pass[2];
+        tank->ch[c].high_pass.a1 = pc->high_pass[3];
+        tank->ch[c].high_pass.a2 = pc->high_pass[4];
+    }
 }
 
 
 
-/* push a sample into a comb filter and return the sample falling out */
-rev_t
-comb_run(rev_t insample, COMB_FILTER * comb) {
+#ifdef REVERB_CALC_FP
+/* zero out the lanes of v holding denormals (see biquad_run) */
+static inline
+v_float
+v_flush_biquad(v_float v) {
 
-    rev_t outsample;
-    rev_t pushin;
+    return (v_float)((v_int)v & ((v >= COEF_MIN) | (v <= -COEF_MIN)));
+}
+
+/* zero out the lanes of v which DENORM() would zero */
+static inline
+v_float
+v_denorm(v_float v) {
 
-    pushin = comb->fb_gain * insample + biquad_run(comb->filter, comb->fb_gain * comb->last_out);
-#ifdef REVERB_CALC_FLOAT
-    pushin = DENORM(pushin);
+    return (v_float)((v_int)v & ((v >= (coef_t)0x1p-24) | (v <= -(coef_t)0x1p-24)));
+}
 #endif
-    outsample = push_buffer(pushin,
-                comb->ringbuffer, comb->buflen, comb->buffer_pos);
-#ifdef REVERB_CALC_FLOAT
-    outsample = DENORM(outsample);
+
+
+/* number of samples lane i of a comb bank can process before its
+ * delay line wraps (a position left beyond a shortened buffer by
+ * comp_coeffs() is read once more, then wraps) */
+static inline
+unsigned long
+comb_bank_avail(COMB_BANK * bank, unsigned long i) {
+
+    if (bank->buffer_pos[i] >= bank->buflen[i])
+        return 1;
+    return bank->buflen[i] - bank->buffer_pos[i];
+}
+
+
+/* push a block of samples into every comb filter of a bank, and add
+ * the sum of the samples falling out to out[].  Each group of lanes
+ * runs over the largest chunk that no delay line of the group wraps
+ * in, so the wrap check is done once per chunk instead of per sample.
+ */
+static void
+comb_bank_process(COMB_BANK * bank, const rev_t * in, rev_t * out,
+          unsigned long n) {
+
+    unsigned long g, k, i, t, lanes, done, chunk;
+    rev_t * line[COMB_LANES];
+    v_float fb_gain, fb_gain_step, b0, b1, b2, a1, a2;
+    v_rev x, y, x1, x2, y1, y2, last_out, pushin;
+    rev_t sum;
+
+    for (g = 0; g * COMB_LANES < bank->num_combs; g++) {
+        lanes = bank->num_combs - g * COMB_LANES;
+        if (lanes > COMB_LANES)
+            lanes = COMB_LANES;
+
+        fb_gain = bank->fb_gain[g];
+        fb_gain_step = bank->fb_gain_step[g];
+        b0 = bank->b0[g];
+        b1 = bank->b1[g];
+        b2 = bank->b2[g];
+        a1 = bank->a1[g];
+        a2 = bank->a2[g];
+        x1 = bank->x1[g];
+        x2 = bank->x2[g];
+        y1 = bank->y1[g];
+        y2 = bank->y2[g];
+        last_out = bank->last_out[g];
+
+        for (done = 0; done < n; done += chunk) {
+            chunk = n - done;
+            for (k = 0; k < lanes; k++) {
+                i = g * COMB_LANES + k;
+                if (comb_bank_avail(bank, i) < chunk)
+                    chunk = comb_bank_avail(bank, i);
+                line[k] = bank->ringbuffer[i] + bank->buffer_pos[i];
+            }
+
+            for (t = 0; t < chunk; t++) {
+                /* feedback loop low-pass, see biquad_run() */
+                x = V_F2REV(fb_gain * V_REV2F(last_out));
+                y = V_F2REV(b0 * V_REV2F(x) + b1 * V_REV2F(x1)
+                        + b2 * V_REV2F(x2) + a1 * V_REV2F(y1)
+                        + a2 * V_REV2F(y2));
+#ifdef REVERB_CALC_FP
+                y = v_flush_biquad(y);
+#endif
+                x2 = x1;
+                x1 = x;
+                y2 = y1;
+                y1 = y;
+
+                pushin = V_F2REV(fb_gain * (coef_t)in[done + t] + V_REV2F(y));
+                fb_gain += fb_gain_step;
+#ifdef REVERB_CALC_FP
+                pushin = v_denorm(pushin);
+#endif
+
+                /* the delay lines have to be accessed lane by lane */
+                last_out = (v_rev){0};
+                for (k = 0; k < lanes; k++) {
+                    last_out[k] = line[k][t];
+                    line[k][t] = pushin[k];
+                }
+#ifdef REVERB_CALC_FP
+                last_out = v_denorm(last_out);
 #endif
-    comb->last_out = outsample;
+                sum = 0;
+                for (k = 0; k < lanes; k++)
+                    sum += last_out[k];
+                out[done + t] += sum;
+            }
+
+            for (k = 0; k < lanes; k++) {
+                i = g * COMB_LANES + k;
+                bank->buffer_pos[i] += chunk;
+                if (bank->buffer_pos[i] >= bank->buflen[i])
+                    bank->buffer_pos[i] = 0;
+            }
+        }
 
-    return outsample;
+        bank->fb_gain[g] = fb_gain;
+        bank->x1[g] = x1;
+        bank->x2[g] = x2;
+        bank->y1[g] = y1;
+        bank->y2[g] = y2;
+        bank->last_out[g] = last_out;
+    }
 }
 
 
-/* push a sample into an allpass filter and return the sample falling out */
-rev_t
-allp_run(rev_t insample, ALLP_FILTER * allp) {
+/* push a block of samples through an allpass filter, adding the
+ * samples falling out to buf[] in place.  As with the comb filters,
+ * the delay line wrap is handled once per contiguous chunk. */
+static void
+allp_process(ALLP_FILTER * allp, rev_t * buf, unsigned long n) {
 
+    unsigned long t, done, chunk;
+    unsigned long pos = *(allp->buffer_pos);
+    rev_t * line;
     rev_t outsample;
     rev_t pushin;
-    pushin = allp->in_gain * allp->fb_gain * insample + allp->fb_gain * allp->last_out;
-#ifdef REVERB_CALC_FLOAT
-    pushin = DENORM(pushin);
+    rev_t last_out = allp->last_out;
+    coef_t in_gain = allp->in_gain;
+    coef_t fb_gain = allp->fb_gain;
+
+    for (done = 0; done < n; done += chunk) {
+        chunk = n - done;
+        if (pos >= allp->buflen) {
+            chunk = 1;
+        } else if (allp->buflen - pos < chunk) {
+            chunk = allp->buflen - pos;
+        }
+        line = allp->ringbuffer + pos;
+
+        for (t = 0; t < chunk; t++) {
+            pushin = in_gain * fb_gain * buf[done + t] + fb_gain * last_out;
+            in_gain += allp->in_gain_step;
+            fb_gain += allp->fb_gain_step;
+#ifdef REVERB_CALC_FP
+            pushin = DENORM(pushin);
 #endif
-    outsample = push_buffer(pushin,
-                allp->ringbuffer, allp->buflen, allp->buffer_pos);
-#ifdef REVERB_CALC_FLOAT
-    outsample = DENORM(outsample);
+            outsample = line[t];
+            line[t] = pushin;
+#ifdef REVERB_CALC_FP
+            outsample = DENORM(outsample);
 #endif
-    allp->last_out = outsample;
+            last_out = outsample;
+            buf[done + t] += outsample;
+        }
 
-    return outsample;
+        pos += chunk;
+        if (pos >= allp->buflen)
+            pos = 0;
+    }
+
+    *(allp->buffer_pos) = pos;
+    allp->last_out = last_out;
+    allp->in_gain = in_gain;
+    allp->fb_gain = fb_gain;
 }
 
 
-/* compute user-input-dependent reverberator coefficients */
-void
-comp_coeffs(LV2_Handle Instance) {
+/* compute the decay dependent feedback gains of a tank.  If n > 0, the
+ * gains are ramped from their current values to the new ones over the
+ * next n samples, otherwise they are set right away. */
+static void
+comp_gains(TANK * tank, float decay, unsigned long n) {
 
-    Reverb * ptr = (Reverb *)Instance;
-    int i;
+    COMB_BANK * comb_L = &tank->ch[0].combs;
+    const PRESET_COEFFS * pc = tank->coeffs;
+    float gain, in_gain, allp_in_gain;
+    int i, c;
 
 
-    if (*(ptr->mode) != ptr->old_mode)
-        load_plugin_data(Instance);
+    tank->decay = decay;
+    tank->ramping = (n > 0);
 
-    for (i = 0; i < ptr->num_combs / 2; i++) {
-        ((COMB_FILTER *)(ptr->combs + 2*i))->fb_gain =
-            powf(0.001f,
-                 1000.0f * ((COMB_FILTER *)(ptr->combs + 2*i))->buflen
-                 * (1 + FR_R_COMP * ((COMB_FILTER *)(ptr->combs + 2*i))->freq_resp)
-                 / powf(((COMB_FILTER *)(ptr->combs + 2*i))->feedback/100.0f, 0.89f)
-                 / *(ptr->decay)
-                 / ptr->sample_rate);
+    for (i = 0; i < tank->num_combs / 2; i++) {
+        gain = (decay > 0.0f) ?
+            expf(pc->comb_decay[i] * comb_L->buflen[i] / decay) : 0.0f;
 
-        ((COMB_FILTER *)(ptr->combs + 2*i+1))->fb_gain =
-            ((COMB_FILTER *)(ptr->combs + 2*i))->fb_gain;
+        for (c = 0; c < 2; c++) {
+            COMB_BANK * bank = &tank->ch[c].combs;
 
-        if (*(ptr->stereo_enh) > 0.0f) {
-            if (i % 2 == 0)
-                ((COMB_FILTER *)(ptr->combs + 2*i+1))->buflen =
-                    ENH_STEREO_RATIO * ((COMB_FILTER *)(ptr->combs + 2*i))->buflen;
-            else
-                ((COMB_FILTER *)(ptr->combs + 2*i))->buflen =
-                    ENH_STEREO_RATIO * ((COMB_FILTER *)(ptr->combs + 2*i+1))->buflen;
-        } else {
-            if (i % 2 == 0)
-                ((COMB_FILTER *)(ptr->combs + 2*i+1))->buflen =
-                    ((COMB_FILTER *)(ptr->combs + 2*i))->buflen;
-            else
-                ((COMB_FILTER *)(ptr->combs + 2*i))->buflen =
-                    ((COMB_FILTER *)(ptr->combs + 2*i+1))->buflen;
+            if (n > 0) {
+                LANE(bank->fb_gain_step, i) = (gain - LANE(bank->fb_gain, i)) / n;
+            } else {
+                LANE(bank->fb_gain, i) = gain;
+                LANE(bank->fb_gain_step, i) = 0.0f;
+            }
+        }
+    }
+
+    /* powf(x, 1.5f) == x * sqrtf(x) */
+    allp_in_gain = (decay + 3500.0f) / 10000.0f;
+    allp_in_gain = -0.06f / (allp_in_gain * sqrtf(allp_in_gain));
+
+    for (i = 0; i < tank->num_allps / 2; i++) {
+        gain = (decay > 0.0f) ?
+            expf(pc->allp_decay[i] * tank->ch[0].allps[i].buflen / decay) : 0.0f;
+        in_gain = allp_in_gain / (tank->ch[0].allps[i].feedback/100.0f);
+
+        for (c = 0; c < 2; c++) {
+            ALLP_FILTER * allp = tank->ch[c].allps + i;
+
+            if (n > 0) {
+                allp->fb_gain_step = (gain - allp->fb_gain) / n;
+                allp->in_gain_step = (in_gain - allp->in_gain) / n;
+            } else {
+                allp->fb_gain = gain;
+                allp->in_gain = in_gain;
+                allp->fb_gain_step = 0.0f;
+                allp->in_gain_step = 0.0f;
+            }
         }
     }
+}
 
-    for (i = 0; i < ptr->num_allps / 2; i++) {
-        ((ALLP_FILTER *)(ptr->allps + 2*i))->fb_gain =
-            powf(0.001f, 11000.0f * ((ALLP_FILTER *)(ptr->allps + 2*i))->buflen
-                 / powf(((ALLP_FILTER *)(ptr->allps + 2*i))->feedback/100.0f, 0.88f)
-                 / *(ptr->decay)
-                 / ptr->sample_rate);
 
-        ((ALLP_FILTER *)(ptr->allps + 2*i+1))->fb_gain =
-            ((ALLP_FILTER *)(ptr->allps + 2*i))->fb_gain;
+/* follow the decay control: the gains are computed exactly at block
+ * boundaries only, and ramped linearly over the n samples in between */
+static void
+ramp_gains(TANK * tank, float decay, unsigned long n) {
+
+    if (tank->decay != decay)
+        comp_gains(tank, decay, n);
+    else if (tank->ramping)
+        comp_gains(tank, decay, 0);
+}
+
+
+/* compute user-input-dependent reverberator coefficients */
+static void
+comp_coeffs(Reverb * ptr, TANK * tank, float decay, float stereo_enh) {
+
+    COMB_BANK * comb_L = &tank->ch[0].combs;
+    COMB_BANK * comb_R = &tank->ch[1].combs;
+    const PRESET_COEFFS * pc = tank->coeffs;
+    int i;
 
-        ((ALLP_FILTER *)(ptr->allps + 2*i))->in_gain = -0.06f
-            / (((ALLP_FILTER *)(ptr->allps + 2 * i))->feedback/100.0f)
-            / powf((*(ptr->decay) + 3500.0f) / 10000.0f, 1.5f);
 
-        ((ALLP_FILTER *)(ptr->allps + 2*i+1))->in_gain =
-            ((ALLP_FILTER *)(ptr->allps + 2*i))->in_gain;
+    tank->stereo_enh = stereo_enh;
 
-        if (*(ptr->stereo_enh) > 0.0f) {
+    for (i = 0; i < tank->num_combs / 2; i++) {
+        comb_L->buflen[i] = pc->comb_buflen[i];
+        comb_R->buflen[i] = pc->comb_buflen[i];
+        if (stereo_enh > 0.0f) {
             if (i % 2 == 0)
-                ((ALLP_FILTER *)(ptr->allps + 2*i+1))->buflen =
-                    ENH_STEREO_RATIO * ((ALLP_FILTER *)(ptr->allps + 2*i))->buflen;
+                comb_R->buflen[i] = ENH_STEREO_RATIO * pc->comb_buflen[i];
             else
-                ((ALLP_FILTER *)(ptr->allps + 2*i))->buflen =
-                    ENH_STEREO_RATIO * ((ALLP_FILTER *)(ptr->allps + 2*i+1))->buflen;
-        } else {
+                comb_L->buflen[i] = ENH_STEREO_RATIO * pc->comb_buflen[i];
+        }
+    }
+
+    for (i = 0; i < tank->num_allps / 2; i++) {
+        tank->ch[0].allps[i].buflen = pc->allp_buflen[i];
+        tank->ch[1].allps[i].buflen = pc->allp_buflen[i];
+        if (stereo_enh > 0.0f) {
             if (i % 2 == 0)
-                ((ALLP_FILTER *)(ptr->allps + 2*i+1))->buflen =
-                    ((ALLP_FILTER *)(ptr->allps + 2*i))->buflen;
+                tank->ch[1].allps[i].buflen = ENH_STEREO_RATIO * pc->allp_buflen[i];
             else
-                ((ALLP_FILTER *)(ptr->allps + 2*i))->buflen =
-                    ((ALLP_FILTER *)(ptr->allps + 2*i+1))->buflen;
+                tank->ch[0].allps[i].buflen = ENH_STEREO_RATIO * pc->allp_buflen[i];
         }
     }
+
+    comp_gains(tank, decay, 0);
+}
+
+
+/* clear a tank and load a preset into it */
+static void
+prepare_tank(Reverb * ptr, TANK * tank, float mode, float decay, float stereo_enh) {
+
+    unsigned long i, c;
+
+    for (c = 0; c < 2; c++) {
+        for (i = 0; i < COMB_SLOTS; i++)
+            comb_bank_reset(&tank->ch[c].combs, i);
+        biquad_init(&tank->ch[c].low_pass);
+        biquad_init(&tank->ch[c].high_pass);
+    }
+
+    load_plugin_data(ptr, tank, mode);
+    memset(tank->ringbuffers, 0, tank->ringbuffers_size);
+    comp_coeffs(ptr, tank, decay, stereo_enh);
+}
+
+
+/* make tank t the active one and start crossfading into it */
+static void
+start_fade(Reverb * ptr, unsigned long t) {
+
+    ptr->active = t;
+    ptr->fade_pos = 0;
+}
+
+
+
+static void * helper_thread(void * arg);
+
+
+/* look up the precomputed preset coefficients for a sample rate */
+static const PRESET_COEFFS *
+find_preset_table(unsigned long sample_rate) {
+
+    int i;
+
+    for (i = 0; preset_tables[i].coeffs; i++)
+        if (preset_tables[i].sample_rate == sample_rate)
+            return preset_tables[i].coeffs;
+    return NULL;
+}
+
+
+/* size of the delay line pool of a tank: the delay lines of both
+ * channels of the preset needing the most memory, see load_plugin_data() */
+static size_t
+pool_size(unsigned long sample_rate) {
+
+    unsigned long m, i;
+    size_t size, max_size = 0;
+    const REVERB_DATA * rd;
+
+    for (m = 0; m < NUM_MODES; m++) {
+        rd = reverb_data + m;
+        size = 0;
+        for (i = 0; i < rd->num_combs; i++)
+            size += ARENA_SIZE(sizeof(rev_t) *
+                       DELAY_LINE_LEN(rd->combs[i].delay, sample_rate));
+        for (i = 0; i < rd->num_allps; i++)
+            size += ARENA_SIZE(sizeof(rev_t) *
+                       DELAY_LINE_LEN(rd->allps[i].delay, sample_rate));
+        if (2 * size > max_size)
+            max_size = 2 * size;
+    }
+    return max_size;
 }
 
 
+/* size of the arena holding an instance and all of its buffers */
+static size_t
+arena_size(unsigned long sample_rate) {
+
+    return ARENA_SIZE(sizeof(Reverb))
+        + (find_preset_table(sample_rate) ? 0 :
+           ARENA_SIZE(NUM_MODES * sizeof(PRESET_COEFFS)))
+        + 2 * ARENA_SIZE(sizeof(TANK))
+        + 2 * pool_size(sample_rate);
+}
+
 
 /* Construct a new plugin instance. */
-LV2_Handle
+static LV2_Handle
 instantiate_Reverb(const LV2_Descriptor * Descriptor, double SampleRate, const char* bundle_path, const LV2_Feature* const* features) {
 
-    unsigned long i;
-    LV2_Handle * p;
+    unsigned long i, c, t;
+    size_t size = arena_size(SampleRate);
+    char * arena;
+    char * top;
     Reverb * ptr = NULL;
+    TANK * tank;
+
+    /* everything an instance needs is carved from a single arena,
+       laid out in the order the filters are processed */
+    if (posix_memalign((void **)&arena, ARENA_ALIGN, size) != 0)
+        return NULL;
+    memset(arena, 0, size);
+    top = arena;
+
+    ptr = arena_carve(&top, sizeof(Reverb));
+    ptr->kernel = Descriptor;
+    ptr->sample_rate = SampleRate;
+    ptr->smoothdecay =2800.0f;
+    ptr->smoothdry = -4.0f;
+    ptr->smoothwet = -12.0f;
+    ptr->fade_len = XFADE_TIME * SampleRate / 1000;
+
+    for (i = 0; features && features[i]; i++) {
+        if (!strcmp(features[i]->URI, LV2_WORKER__schedule))
+            ptr->schedule = (LV2_Worker_Schedule *)features[i]->data;
+    }
 
-    if ((p = malloc(sizeof(Reverb))) != NULL) {
-        ((Reverb *)p)->sample_rate = SampleRate;
-        ((Reverb *)p)->smoothdecay =2800.0f;
-        ((Reverb *)p)->smoothdry = -4.0f;
-        ((Reverb *)p)->smoothwet = -12.0f;
-
-        ptr = (Reverb *)p;
-
-        /* allocate memory for comb/allpass filters and other dynamic vars */
-        if ((ptr->combs =
-             calloc(2 * MAX_COMBS, sizeof(COMB_FILTER))) == NULL)
-            return NULL;
-        for (i = 0; i < 2 * MAX_COMBS; i++) {
-            if ((((COMB_FILTER *)(ptr->combs + i))->ringbuffer =
-                 calloc((unsigned long)MAX_COMB_DELAY * ptr->sample_rate / 1000,
-                    sizeof(float))) == NULL)
-                return NULL;
-            if ((((COMB_FILTER *)(ptr->combs + i))->buffer_pos =
-                 calloc(1, sizeof(unsigned long))) == NULL)
-                return NULL;
-            if ((((COMB_FILTER *)(ptr->combs + i))->filter =
-                 calloc(1, sizeof(biquad))) == NULL)
-                return NULL;
-        }
+    /* unusual sample rate: compute the coefficients of all presets now */
+    if ((ptr->coeffs = find_preset_table(ptr->sample_rate)) == NULL) {
+        PRESET_COEFFS * coeffs =
+            arena_carve(&top, NUM_MODES * sizeof(PRESET_COEFFS));
+        for (i = 0; i < NUM_MODES; i++)
+            preset_coeffs(coeffs + i, reverb_data + i, ptr->sample_rate);
+        ptr->coeffs = coeffs;
+    }
 
-        if ((ptr->allps =
-             calloc(2 * MAX_ALLPS, sizeof(ALLP_FILTER))) == NULL)
-            return NULL;
-        for (i = 0; i < 2 * MAX_ALLPS; i++) {
-            if ((((ALLP_FILTER *)(ptr->allps + i))->ringbuffer =
-                 calloc((unsigned long)MAX_ALLP_DELAY * ptr->sample_rate / 1000,
-                    sizeof(float))) == NULL)
-                return NULL;
-            if ((((ALLP_FILTER *)(ptr->allps + i))->buffer_pos =
-                 calloc(1, sizeof(unsigned long))) == NULL)
-                return NULL;
-        }
+    ptr->tanks = arena_carve(&top, sizeof(TANK));
+    arena_carve(&top, sizeof(TANK));
 
-        if ((ptr->low_pass =
-             calloc(2, sizeof(biquad))) == NULL)
-            return NULL;
-        if ((ptr->high_pass =
-             calloc(2, sizeof(biquad))) == NULL)
-            return NULL;
+    /* delay line pools, laid out by load_plugin_data() */
+    for (t = 0; t < 2; t++) {
+        tank = ptr->tanks + t;
+        tank->ringbuffers = arena_carve(&top, pool_size(ptr->sample_rate));
+        for (c = 0; c < 2; c++)
+            for (i = 0; i < MAX_ALLPS; i++)
+                tank->ch[c].allps[i].buffer_pos = tank->ch[c].allp_pos + i;
+    }
 
-        return p;
+    /* run the right channel on a second core if asked to */
+    if (getenv("TAP_REVERB_THREADS") && sysconf(_SC_NPROCESSORS_ONLN) > 1
+        && sem_init(&ptr->thread_go, 0, 0) == 0) {
+        if (pthread_create(&ptr->thread, NULL, helper_thread, ptr) == 0)
+            ptr->threaded = 1;
+        else
+            sem_destroy(&ptr->thread_go);
     }
-    return NULL;
+
+    return (LV2_Handle)ptr;
 }
 
 
 /* activate a plugin instance */
-void
+static void
 activate_Reverb(LV2_Handle Instance) {
 
     Reverb * ptr = (Reverb *)Instance;
-    unsigned long i,j;
-
-    for (i = 0; i < 2 * MAX_COMBS; i++) {
-        for (j = 0; j < (unsigned long)MAX_COMB_DELAY * ptr->sample_rate / 1000; j++)
-                ((COMB_FILTER *)(ptr->combs + i))->ringbuffer[j] = 0.0f;
-        *(((COMB_FILTER *)(ptr->combs + i))->buffer_pos) = 0;
-        ((COMB_FILTER *)(ptr->combs + i))->last_out = 0;
-        biquad_init(((COMB_FILTER *)(ptr->combs + i))->filter);
-    }
+    unsigned long t;
 
-    for (i = 0; i < 2 * MAX_ALLPS; i++) {
-        for (j = 0; j < (unsigned long)MAX_ALLP_DELAY * ptr->sample_rate / 1000; j++)
-            ((ALLP_FILTER *)(ptr->allps + i))->ringbuffer[j] = 0.0f;
-        *(((ALLP_FILTER *)(ptr->allps + i))->buffer_pos) = 0;
-        ((ALLP_FILTER *)(ptr->allps + i))->last_out = 0;
-    }
+    /* a tank still being loaded by the worker stays with it until the
+       response arrives, which is then dropped: start from the other one */
+    ptr->work_gen++;
+    ptr->active = ptr->work_pending ? !ptr->work_tank : 0;
 
-    biquad_init(ptr->low_pass);
-    biquad_init((biquad *)(ptr->low_pass + 1));
-    biquad_init(ptr->high_pass);
-    biquad_init((biquad *)(ptr->high_pass + 1));
+    /* the delay lines in use are cleared when a preset is loaded */
+    for (t = 0; t < 2; t++)
+        if (!ptr->work_pending || t != ptr->work_tank)
+            ptr->tanks[t].mode = -1.0f;
+
+    ptr->fade_pos = ptr->fade_len;
+    ptr->silence = 0;
+    ptr->idle = 0;
 
-    ptr->old_decay = -10.0f;
-    ptr->old_stereo_enh = -10.0f;
-    ptr->old_mode = -10.0f;
 }
 
 /* Connect a port to a data location. */
-void
+static void
 connect_port_Reverb(LV2_Handle Instance,
              uint32_t Port,
              void * DataLocation) {
@@ -405,16 +704,164 @@ connect_port_Reverb(LV2_Handle Instance,
 
 
 
-void
+/* run one channel of a tank over a block of input samples */
+static void
+tank_process(TANK_CHANNEL * ch, unsigned long num_allps, const rev_t * in, rev_t * wet,
+         unsigned long n, float combs_en, float allps_en, float bandpass_en) {
+
+    unsigned long i, t;
+
+    for (t = 0; t < n; t++)
+        wet[t] = in[t];
+
+    /* process comb filters */
+    if (combs_en > 0.0f)
+        comb_bank_process(&ch->combs, in, wet, n);
+
+    /* process allpass filters */
+    if (allps_en > 0.0f) {
+        for (i = 0; i < num_allps; i++)
+            allp_process(ch->allps + i, wet, n);
+    }
+
+    /* process bandpass filters */
+    if (bandpass_en > 0.0f) {
+        for (t = 0; t < n; t++) {
+            wet[t] = biquad_run(&ch->low_pass, wet[t]);
+            wet[t] = biquad_run(&ch->high_pass, wet[t]);
+        }
+    }
+}
+
+
+/* Run one channel over the whole period, mixing into its output.  The
+ * channels share nothing but read-only settings, so the right one may be
+ * run by the helper thread while the audio thread runs the left one. */
+static void
+run_channel(Reverb * ptr, unsigned long c) {
+
+    TANK * tank = ptr->tanks + ptr->active;
+    TANK * old_tank = ptr->tanks + !ptr->active;
+    TANK_CHANNEL * ch = tank->ch + c;
+    TANK_CHANNEL * old_ch = old_tank->ch + c;
+    float * input = c ? ptr->input_R : ptr->input_L;
+    float * output = c ? ptr->output_R : ptr->output_L;
+    float drylevel = ptr->dry_gain;
+    float wetlevel = ptr->wet_gain;
+    unsigned long fade_pos = ptr->fade_pos;
+    unsigned long fade_len = ptr->fade_len;
+    rev_t * in = ptr->block_in[c];
+    rev_t * wet = ch->wet;
+    rev_t * wet_old = old_ch->wet;
+    unsigned long offset, n, t;
+    float fade_in, fade_in_step, fade_out, fade_out_step;
+    float peak = 0.0f;
+
+    /* process in blocks of at most REVERB_BLOCK samples, one filter
+       at a time over the whole block */
+    for (offset = 0; offset < ptr->count; offset += n) {
+        n = ptr->count - offset;
+        if (n > REVERB_BLOCK)
+            n = REVERB_BLOCK;
+
+        for (t = 0; t < n; t++) {
+#ifdef REVERB_CALC_FP
+            in[t] = input[offset + t];
+#else
+            in[t] = (sample)((float)F2S * input[offset + t]);
+#endif
+        }
+
+        tank_process(ch, tank->num_allps / 2, in, wet, n,
+                 ptr->combs_on, ptr->allps_on, ptr->bandpass_on);
+
+        /* equal power crossfade from the previous preset */
+        if (fade_pos < fade_len) {
+            tank_process(old_ch, old_tank->num_allps / 2, in, wet_old, n,
+                     ptr->combs_on, ptr->allps_on, ptr->bandpass_on);
+
+            fade_in = sinf(0.5f * M_PI * fade_pos / fade_len);
+            fade_out = cosf(0.5f * M_PI * fade_pos / fade_len);
+            t = LIMIT(fade_pos + n, 0, fade_len);
+            fade_in_step = (sinf(0.5f * M_PI * t / fade_len) - fade_in) / n;
+            fade_out_step = (cosf(0.5f * M_PI * t / fade_len) - fade_out) / n;
+            for (t = 0; t < n; t++) {
+                wet[t] = fade_in * wet[t] + fade_out * wet_old[t];
+                fade_in += fade_in_step;
+                fade_out += fade_out_step;
+            }
+            fade_pos += n;
+        }
+
+        for (t = 0; t < n; t++) {
+#ifdef REVERB_CALC_FP
+            output[offset + t] = in[t] * drylevel + wet[t] * wetlevel;
+#else
+            output[offset + t] = (float)(sample)((float)in[t] * drylevel
+                                 + (float)wet[t] * wetlevel) / (float)F2S;
+#endif
+        }
+
+        if (ptr->measure)
+            for (t = 0; t < n; t++)
+                if (fabsf(output[offset + t]) > peak)
+                    peak = fabsf(output[offset + t]);
+    }
+
+    ptr->out_peak[c] = peak;
+}
+
+
+/* is the input of the next count samples below SILENCE_LEVEL? */
+static int
+input_silent(Reverb * ptr, unsigned long count) {
+
+    unsigned long t;
+    float peak = 0.0f;
+
+    for (t = 0; t < count; t++) {
+        if (fabsf(ptr->input_L[t]) > peak)
+            peak = fabsf(ptr->input_L[t]);
+        if (fabsf(ptr->input_R[t]) > peak)
+            peak = fabsf(ptr->input_R[t]);
+    }
+    return peak < SILENCE_LEVEL;
+}
+
+
+/* helper thread: runs the right channel whenever the audio thread asks */
+static void *
+helper_thread(void * arg) {
+
+    Reverb * ptr = (Reverb *)arg;
+    int job;
+
+    for (;;) {
+        while (sem_wait(&ptr->thread_go) != 0)
+            ;
+        if (__atomic_load_n(&ptr->thread_quit, __ATOMIC_ACQUIRE))
+            break;
+        /* the audio thread may have run the channel itself already */
+        job = JOB_POSTED;
+        if (__atomic_compare_exchange_n(&ptr->thread_job, &job, JOB_CLAIMED, 0,
+                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            run_channel(ptr, 1);
+            __atomic_store_n(&ptr->thread_job, JOB_DONE, __ATOMIC_RELEASE);
+        }
+    }
+    return NULL;
+}
+
+
+static void
 run_Reverb(LV2_Handle Instance,
         uint32_t SampleCount) {
 
     Reverb * ptr = (Reverb *)Instance;
 
-    unsigned long sample_index;
-    int i;
-
     float calcdecay = (*(ptr->decay)+ptr->smoothdecay)*0.5; //first calculate the smoothed value, then limit it.
+    if (fabsf(calcdecay - *(ptr->decay)) < 0.01f) //settle, don't recompute the gains forever
+        calcdecay = *(ptr->decay);
     ptr->smoothdecay = calcdecay;
     float decay = LIMIT(calcdecay,0.0f,10000.0f);
 
@@ -433,129 +880,195 @@ run_Reverb(LV2_Handle Instance,
     float stereo_enh = LIMIT(*(ptr->stereo_enh),-2.0f,2.0f);
     float mode = LIMIT(*(ptr->mode),0,NUM_MODES-1);
 
-    float * input_L = ptr->input_L;
-    float * output_L = ptr->output_L;
-    float * input_R = ptr->input_R;
-    float * output_R = ptr->output_R;
-
-    rev_t out_L = 0;
-    rev_t out_R = 0;
-    rev_t in_L = 0;
-    rev_t in_R = 0;
-    rev_t combs_out_L = 0;
-    rev_t combs_out_R = 0;
-
+    TANK * tank = ptr->tanks + ptr->active;
+    TANK * old_tank = ptr->tanks + !ptr->active;
+    TANK_REQUEST req;
+    struct sched_param param;
+    int policy, spin, job;
+
+
+    if (tank->mode < 0.0f) {
+        /* nothing loaded since activation: load the preset right away */
+        prepare_tank(ptr, tank, mode, decay, stereo_enh);
+    } else if (tank->mode != mode && !ptr->work_pending &&
+           ptr->fade_pos >= ptr->fade_len) {
+        /* load the new preset into the idle tank, off the audio thread
+           if the host lets us, then crossfade into it */
+        req.tank = !ptr->active;
+        req.gen = ptr->work_gen;
+        req.mode = mode;
+        req.decay = decay;
+        req.stereo_enh = stereo_enh;
+        if (ptr->schedule) {
+            if (ptr->schedule->schedule_work(ptr->schedule->handle,
+                             sizeof(req), &req) == LV2_WORKER_SUCCESS) {
+                ptr->work_pending = 1;
+                ptr->work_tank = req.tank;
+            }
+        } else {
+            prepare_tank(ptr, ptr->tanks + req.tank,
+                     req.mode, req.decay, req.stereo_enh);
+            start_fade(ptr, req.tank);
+            tank = ptr->tanks + ptr->active;
+            old_tank = ptr->tanks + !ptr->active;
+        }
+    }
 
-    /* see if the user changed any control since last run */
-    if ((ptr->old_decay != decay) ||
-        (ptr->old_stereo_enh != stereo_enh) ||
-        (ptr->old_mode != mode)) {
+    /* the stereo enhancement changes the delay lengths */
+    if (tank->stereo_enh != stereo_enh)
+        comp_coeffs(ptr, tank, decay, stereo_enh);
+    if (ptr->fade_pos < ptr->fade_len && old_tank->stereo_enh != stereo_enh)
+        comp_coeffs(ptr, old_tank, decay, stereo_enh);
+
+    /* the decay only changes the feedback gains: ramp them */
+    ramp_gains(tank, decay, SampleCount);
+    if (ptr->fade_pos < ptr->fade_len)
+        ramp_gains(old_tank, decay, SampleCount);
+
+    /* Once the input has been silent for longer than the tail of the
+       preset takes to die away (twice the decay time, which is given
+       for 60 dB, plus the longest path through the filters), the output
+       is checked, and if it is silent too the filters are left alone
+       until the input comes back. */
+    if (input_silent(ptr, SampleCount)) {
+        ptr->silence += SampleCount;
+    } else {
+        ptr->silence = 0;
+        ptr->idle = 0;
+    }
+    if (ptr->fade_pos < ptr->fade_len)
+        ptr->idle = 0;
 
-        /* re-compute reverberator coefficients */
-        comp_coeffs(Instance);
+    if (ptr->idle) {
+        memset(ptr->output_L, 0, SampleCount * sizeof(float));
+        memset(ptr->output_R, 0, SampleCount * sizeof(float));
+        return;
+    }
 
-        /* save new values */
-        ptr->old_decay = decay;
-        ptr->old_stereo_enh = stereo_enh;
-        ptr->old_mode = mode;
+    ptr->measure = (ptr->fade_pos >= ptr->fade_len && ptr->silence >=
+            tank->tail_delay + 2.0f * decay * ptr->sample_rate / 1000.0f);
+
+    ptr->count = SampleCount;
+    ptr->dry_gain = drylevel;
+    ptr->wet_gain = wetlevel;
+    ptr->combs_on = combs_en;
+    ptr->allps_on = allps_en;
+    ptr->bandpass_on = bandpass_en;
+
+    /* give the helper the RT priority of the audio thread; a helper
+       running below it would only make the audio thread wait */
+    if (ptr->threaded && !ptr->thread_sched) {
+        if (pthread_getschedparam(pthread_self(), &policy, &param) == 0
+            && (policy == SCHED_FIFO || policy == SCHED_RR)
+            && pthread_setschedparam(ptr->thread, policy, &param) == 0)
+            ptr->thread_sched = 1;
+        else
+            ptr->thread_sched = -1;
     }
 
-    for (sample_index = 0; sample_index < SampleCount; sample_index++) {
+    if (ptr->threaded && ptr->thread_sched > 0) {
+        __atomic_store_n(&ptr->thread_job, JOB_POSTED, __ATOMIC_RELEASE);
+        sem_post(&ptr->thread_go);
+        run_channel(ptr, 0);
+
+        /* give the helper a little time, then run the channel here
+           unless the helper has started on it */
+        for (spin = 0; spin < HELPER_SPIN &&
+                 __atomic_load_n(&ptr->thread_job, __ATOMIC_ACQUIRE) != JOB_DONE; spin++)
+            sched_yield();
+        job = JOB_POSTED;
+        if (__atomic_compare_exchange_n(&ptr->thread_job, &job, JOB_NONE, 0,
+                        __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE))
+            run_channel(ptr, 1);
+        else
+            while (__atomic_load_n(&ptr->thread_job, __ATOMIC_ACQUIRE) != JOB_DONE)
+                sched_yield();
+    } else {
+        run_channel(ptr, 0);
+        run_channel(ptr, 1);
+    }
 
-#ifdef REVERB_CALC_FLOAT
-        in_L = *(input_L++);
-        in_R = *(input_R++);
-#else
-        in_L = (sample)((float)F2S * *(input_L++));
-        in_R = (sample)((float)F2S * *(input_R++));
-#endif
+    if (ptr->fade_pos < ptr->fade_len)
+        ptr->fade_pos += SampleCount;
 
-        combs_out_L = in_L;
-        combs_out_R = in_R;
+    if (IDLE_ALLOWED && ptr->measure && ptr->out_peak[0] < SILENCE_LEVEL
+        && ptr->out_peak[1] < SILENCE_LEVEL)
+        ptr->idle = 1;
+}
 
-        /* process comb filters */
-        if (combs_en > 0.0f) {
-            for (i = 0; i < ptr->num_combs / 2; i++) {
-                combs_out_L +=
-                    comb_run(in_L, ((COMB_FILTER *)(ptr->combs + 2*i)));
-                combs_out_R +=
-                    comb_run(in_R, ((COMB_FILTER *)(ptr->combs + 2*i+1)));
-            }
-        }
 
-        /* process allpass filters */
-        if (allps_en > 0.0f) {
-            for (i = 0; i < ptr->num_allps / 2; i++) {
-                combs_out_L += allp_run(combs_out_L,
-                               ((ALLP_FILTER *)(ptr->allps + 2*i)));
-                combs_out_R += allp_run(combs_out_R,
-                               ((ALLP_FILTER *)(ptr->allps + 2*i+1)));
-            }
-        }
+/* Throw away a Reverb effect instance. */
+static void
+cleanup_Reverb(LV2_Handle Instance) {
 
-        /* process bandpass filters */
-        if (bandpass_en > 0.0f) {
-            combs_out_L =
-                biquad_run(((biquad *)(ptr->low_pass)), combs_out_L);
-            combs_out_L =
-                biquad_run(((biquad *)(ptr->high_pass)), combs_out_L);
-            combs_out_R =
-                biquad_run(((biquad *)(ptr->low_pass + 1)), combs_out_R);
-            combs_out_R =
-                biquad_run(((biquad *)(ptr->high_pass + 1)), combs_out_R);
-        }
+    Reverb * ptr = (Reverb *)Instance;
 
-#ifdef REVERB_CALC_FLOAT
-        out_L = in_L * drylevel + combs_out_L * wetlevel;
-        out_R = in_R * drylevel + combs_out_R * wetlevel;
-        *(output_L++) = out_L;
-        *(output_R++) = out_R;
-#else
-        out_L = (sample)((float)in_L * drylevel + (float)combs_out_L * wetlevel);
-        out_R = (sample)((float)in_R * drylevel + (float)combs_out_R * wetlevel);
-        *(output_L++) = (float)out_L / (float)F2S;
-        *(output_R++) = (float)out_R / (float)F2S;
-#endif
+    if (ptr->threaded) {
+        __atomic_store_n(&ptr->thread_quit, 1, __ATOMIC_RELEASE);
+        sem_post(&ptr->thread_go);
+        pthread_join(ptr->thread, NULL);
+        sem_destroy(&ptr->thread_go);
     }
-}
 
+    /* the instance is the head of its arena, see instantiate_Reverb() */
+    free(Instance);
+}
 
-/* Throw away a Reverb effect instance. */
-void
-cleanup_Reverb(LV2_Handle Instance) {
+/* load a preset into the idle tank, called by the host's worker thread */
+static LV2_Worker_Status
+work_Reverb(LV2_Handle Instance,
+        LV2_Worker_Respond_Function respond,
+        LV2_Worker_Respond_Handle handle,
+        uint32_t size,
+        const void * data) {
 
-    int i;
     Reverb * ptr = (Reverb *)Instance;
+    const TANK_REQUEST * req = (const TANK_REQUEST *)data;
 
-    /* free memory allocated for comb/allpass filters & co. in instantiate_Reverb() */
-    for (i = 0; i < 2 * MAX_COMBS; i++) {
-        free(((COMB_FILTER *)(ptr->combs + i))->ringbuffer);
-        free(((COMB_FILTER *)(ptr->combs + i))->buffer_pos);
-        free(((COMB_FILTER *)(ptr->combs + i))->filter);
-    }
-    for (i = 0; i < 2 * MAX_ALLPS; i++) {
-        free(((ALLP_FILTER *)(ptr->allps + i))->ringbuffer);
-        free(((ALLP_FILTER *)(ptr->allps + i))->buffer_pos);
-    }
+    if (size != sizeof(TANK_REQUEST))
+        return LV2_WORKER_ERR_UNKNOWN;
 
-    free(ptr->combs);
-    free(ptr->allps);
-    free(ptr->low_pass);
-    free(ptr->high_pass);
+    prepare_tank(ptr, ptr->tanks + req->tank,
+             req->mode, req->decay, req->stereo_enh);
 
-    free(Instance);
+    return respond(handle, size, data);
+}
+
+
+/* the idle tank is ready: crossfade into it (called from the audio thread) */
+static LV2_Worker_Status
+work_response_Reverb(LV2_Handle Instance,
+             uint32_t size,
+             const void * data) {
+
+    Reverb * ptr = (Reverb *)Instance;
+    const TANK_REQUEST * req = (const TANK_REQUEST *)data;
 
+    /* sent before the last activate(): the tank is not faded in */
+    if (req->gen == ptr->work_gen)
+        start_fade(ptr, req->tank);
+    ptr->work_pending = 0;
+
+    return LV2_WORKER_SUCCESS;
 }
 
-const void*
+
+static const void *
 extension_data_Reverb(const char* uri)
 {
+    static const LV2_Worker_Interface worker = {
+        work_Reverb,
+        work_response_Reverb,
+        NULL
+    };
+
+    if (!strcmp(uri, LV2_WORKER__interface))
+        return &worker;
     return NULL;
 }
 
 
-static const
-LV2_Descriptor Descriptor = {
+const LV2_Descriptor REVERB_KERNEL = {
     "http://moddevices.com/plugins/tap/reverb",
     instantiate_Reverb,
     connect_port_Reverb,
@@ -566,6 +1079,106 @@ LV2_Descriptor Descriptor = {
     extension_data_Reverb
 };
 
+
+#ifndef REVERB_CALC_FP
+/* The plugin seen by the host: each call is passed on to the kernel the
+ * instance was created by, which is the first member of every Reverb. */
+
+extern const LV2_Descriptor reverb_kernel_float;
+extern const LV2_Descriptor reverb_kernel_double;
+
+#define KERNEL(Instance) (*(const LV2_Descriptor **)(Instance))
+
+
+static LV2_Handle
+instantiate_dispatch(const LV2_Descriptor * Descriptor, double SampleRate, const char* bundle_path, const LV2_Feature* const* features) {
+
+    const LV2_Descriptor * kernel = &reverb_kernel_fixed;
+    const char * name = getenv("TAP_REVERB_KERNEL");
+
+    if (name && !strcmp(name, "float"))
+        kernel = &reverb_kernel_float;
+    else if (name && !strcmp(name, "double"))
+        kernel = &reverb_kernel_double;
+
+    return kernel->instantiate(kernel, SampleRate, bundle_path, features);
+}
+
+static void
+connect_port_dispatch(LV2_Handle Instance, uint32_t Port, void * DataLocation) {
+
+    KERNEL(Instance)->connect_port(Instance, Port, DataLocation);
+}
+
+static void
+activate_dispatch(LV2_Handle Instance) {
+
+    KERNEL(Instance)->activate(Instance);
+}
+
+static void
+run_dispatch(LV2_Handle Instance, uint32_t SampleCount) {
+
+    KERNEL(Instance)->run(Instance, SampleCount);
+}
+
+static void
+cleanup_dispatch(LV2_Handle Instance) {
+
+    KERNEL(Instance)->cleanup(Instance);
+}
+
+static LV2_Worker_Status
+work_dispatch(LV2_Handle Instance,
+          LV2_Worker_Respond_Function respond,
+          LV2_Worker_Respond_Handle handle,
+          uint32_t size,
+          const void * data) {
+
+    const LV2_Worker_Interface * worker =
+        KERNEL(Instance)->extension_data(LV2_WORKER__interface);
+
+    return worker->work(Instance, respond, handle, size, data);
+}
+
+static LV2_Worker_Status
+work_response_dispatch(LV2_Handle Instance,
+               uint32_t size,
+               const void * data) {
+
+    const LV2_Worker_Interface * worker =
+        KERNEL(Instance)->extension_data(LV2_WORKER__interface);
+
+    return worker->work_response(Instance, size, data);
+}
+
+static const void *
+extension_data_dispatch(const char* uri)
+{
+    static const LV2_Worker_Interface worker = {
+        work_dispatch,
+        work_response_dispatch,
+        NULL
+    };
+
+    if (!strcmp(uri, LV2_WORKER__interface))
+        return &worker;
+    return NULL;
+}
+
+
+static const
+LV2_Descriptor Descriptor = {
+    "http://moddevices.com/plugins/tap/reverb",
+    instantiate_dispatch,
+    connect_port_dispatch,
+    activate_dispatch,
+    run_dispatch,
+    NULL,
+    cleanup_dispatch,
+    extension_data_dispatch
+};
+
 LV2_SYMBOL_EXPORT
 const LV2_Descriptor*
 lv2_descriptor(uint32_t index)
@@ -574,3 +1187,4 @@ lv2_descriptor(uint32_t index)
     else return NULL;
 
 }
+#endif /* REVERB_CALC_FP */
@@ -21,6 +21,8 @@
 #define _ISOC99_SOURCE
 #endif
 
+#include <float.h>
+#include <stddef.h>
 #include <stdint.h>
 
 
@@ -60,6 +62,34 @@
 #define FREQ_RESP_BWIDTH  3.0f
 #define ENH_STEREO_RATIO  0.998f
 
+/* delay line length (in samples) carved for a filter of delay d (in s):
+ * one more than its buffer length, which the stereo enhancement can
+ * only shorten */
+#define DELAY_LINE_LEN(d, sr) ((unsigned long)((d) * (sr)) + 1)
+
+/* length of the crossfade between two presets (ms) */
+#define XFADE_TIME        50.0f
+
+/* level (-120 dB) below which the input and the reverb tail are silent */
+#define SILENCE_LEVEL     0.000001f
+
+/* largest number of samples processed by one pass over the filters */
+#define REVERB_BLOCK      256
+
+/* state of the right channel handed to the helper thread */
+#define JOB_NONE          0
+#define JOB_POSTED        1  /* waiting for the helper */
+#define JOB_CLAIMED       2  /* being run by the helper */
+#define JOB_DONE          3
+
+/* times the audio thread yields to the helper before it takes back a
+   channel the helper has not started on */
+#define HELPER_SPIN       64
+
+/* alignment of the blocks carved from an instance arena */
+#define ARENA_ALIGN       64
+#define ARENA_SIZE(n)     (((n) + ARENA_ALIGN - 1) & ~((size_t)ARENA_ALIGN - 1))
+
 /* compensation ratio of freq_resp in fb_gain calc */
 #define FR_R_COMP         0.75f
 
@@ -195,46 +225,125 @@ hp_set_params(biquad *f, bq_t fc, bq_t bw, bq_t fs)
         f->a2 = a0r * (alpha - 1.0);
 }
 
+/* Type of the filter coefficients (and of the gains applied to the
+ * samples), float unless the filters run in double precision.  Values
+ * below COEF_MIN in magnitude are denormal. */
+#ifdef REVERB_CALC_DOUBLE
+typedef double coef_t;
+typedef int64_t mask_t;
+#define COEF_MIN DBL_MIN
+#else
+typedef float coef_t;
+typedef int32_t mask_t;
+#define COEF_MIN FLT_MIN
+#endif
+
 static inline
 rev_t
 biquad_run(biquad *f, rev_t x) {
 
-    union {
-      rev_t y;
-      uint32_t y_int;
-    } u;
-
-        u.y = f->b0 * x + f->b1 * f->x1 + f->b2 * f->x2
+        rev_t y = f->b0 * x + f->b1 * f->x1 + f->b2 * f->x2
                 + f->a1 * f->y1 + f->a2 * f->y2;
-#ifdef REVERB_CALC_FLOAT
-    if ((u.y_int & 0x7f800000) == 0)
-      u.y = 0.0f;
+#ifdef REVERB_CALC_FP
+    if (y < COEF_MIN && y > -COEF_MIN)
+      y = 0;
 #endif
         f->x2 = f->x1;
         f->x1 = x;
         f->y2 = f->y1;
-        f->y1 = u.y;
+        f->y1 = y;
 
-        return u.y;
+        return y;
 }
 
 
 
+/* Comb filter bank.
+ *
+ * The comb filters of one channel are stored as a structure of arrays,
+ * so that COMB_LANES of them can be updated with a single vector
+ * instruction (4 lanes with SSE/NEON, 8 lanes with AVX, half as many in
+ * double precision).  Only the delay line accesses are done lane by
+ * lane, since every comb has its own buffer length and position.
+ */
+
+#if defined(__AVX__) && !defined(REVERB_CALC_DOUBLE)
+#define COMB_LANES 8
+#elif defined(__AVX__) || !defined(REVERB_CALC_DOUBLE)
+#define COMB_LANES 4
+#else
+#define COMB_LANES 2
+#endif
+
+#define COMB_GROUPS ((MAX_COMBS + COMB_LANES - 1) / COMB_LANES)
+#define COMB_SLOTS  (COMB_GROUPS * COMB_LANES)
+
+typedef coef_t v_float __attribute__((vector_size(COMB_LANES * sizeof(coef_t))));
+typedef rev_t v_rev __attribute__((vector_size(COMB_LANES * sizeof(rev_t))));
+typedef mask_t v_int __attribute__((vector_size(COMB_LANES * sizeof(mask_t))));
+
+#ifdef REVERB_CALC_FP
+#define V_REV2F(v) (v)
+#define V_F2REV(v) (v)
+#else
+#define V_REV2F(v) __builtin_convertvector((v), v_float)
+#define V_F2REV(v) __builtin_convertvector((v), v_rev)
+#endif
+
+/* access the value of comb i in a per-group vector array */
+#define LANE(v, i) ((v)[(i) / COMB_LANES][(i) % COMB_LANES])
+
 typedef struct {
-    float feedback;
-    float fb_gain;
-    float freq_resp;
-    rev_t * ringbuffer;
-    unsigned long buflen;
-    unsigned long * buffer_pos;
-    biquad * filter;
-    rev_t last_out;
-} COMB_FILTER;
+    v_float fb_gain[COMB_GROUPS];
+    v_float fb_gain_step[COMB_GROUPS]; /* per sample, while ramping */
+    v_float b0[COMB_GROUPS]; /* feedback loop low-pass coefficients */
+    v_float b1[COMB_GROUPS];
+    v_float b2[COMB_GROUPS];
+    v_float a1[COMB_GROUPS];
+    v_float a2[COMB_GROUPS];
+    v_rev x1[COMB_GROUPS]; /* feedback loop low-pass state */
+    v_rev x2[COMB_GROUPS];
+    v_rev y1[COMB_GROUPS];
+    v_rev y2[COMB_GROUPS];
+    v_rev last_out[COMB_GROUPS];
+    rev_t * ringbuffer[COMB_SLOTS];
+    unsigned long buflen[COMB_SLOTS];
+    unsigned long buffer_pos[COMB_SLOTS];
+    unsigned long num_combs;
+} COMB_BANK;
+
+
+/* copy the coefficients of a biquad into lane i of a comb bank */
+static inline
+void
+comb_bank_set_filter(COMB_BANK * bank, unsigned long i, biquad * f) {
+
+        LANE(bank->b0, i) = f->b0;
+        LANE(bank->b1, i) = f->b1;
+        LANE(bank->b2, i) = f->b2;
+        LANE(bank->a1, i) = f->a1;
+        LANE(bank->a2, i) = f->a2;
+}
+
+/* clear the state of lane i of a comb bank */
+static inline
+void
+comb_bank_reset(COMB_BANK * bank, unsigned long i) {
+
+        bank->buffer_pos[i] = 0;
+        LANE(bank->x1, i) = 0;
+        LANE(bank->x2, i) = 0;
+        LANE(bank->y1, i) = 0;
+        LANE(bank->y2, i) = 0;
+        LANE(bank->last_out, i) = 0;
+}
 
 typedef struct {
     float feedback;
-    float fb_gain;
-    float in_gain;
+    coef_t fb_gain;
+    coef_t in_gain;
+    coef_t fb_gain_step; /* per sample, while ramping */
+    coef_t in_gain_step;
     rev_t * ringbuffer;
     unsigned long buflen;
     unsigned long * buffer_pos;
@@ -242,15 +351,88 @@ typedef struct {
 } ALLP_FILTER;
 
 
-/* The structure used to hold port connection information and state */
+/* Coefficients of a preset at a given sample rate, derived from its
+ * REVERB_DATA by preset_coeffs().  The feedback gain of a filter with
+ * a delay line of buflen samples is exp(decay_coef * buflen / decay).
+ * These are precomputed for the common sample rates at build time (see
+ * tap_reverb_gen.c), and at instantiation time for any other rate.
+ */
+
+typedef struct {
+    uint32_t comb_buflen[MAX_COMBS];
+    float comb_decay[MAX_COMBS];
+    float comb_lp[MAX_COMBS][3]; /* b0 (= b1/2 = b2), a1, a2 */
+    uint32_t allp_buflen[MAX_ALLPS];
+    float allp_decay[MAX_ALLPS];
+    float low_pass[5]; /* b0, b1, b2, a1, a2 */
+    float high_pass[5];
+} PRESET_COEFFS;
+
+typedef struct {
+    unsigned long sample_rate;
+    const PRESET_COEFFS * coeffs; /* NUM_MODES entries */
+} PRESET_TABLE;
+
+
+/* A reverberator tank: the comb/allpass/bandpass filters of one preset.
+ * Each instance has two of them, so that a new preset can be prepared
+ * in the idle tank off the audio thread and crossfaded in. */
+
+/* The filters of one channel of a tank.  The channels only meet in the
+ * final mix, so each is kept on cache lines of its own and may be run
+ * by a thread of its own. */
+
+typedef struct {
+    COMB_BANK combs;
+    ALLP_FILTER allps[MAX_ALLPS];
+    unsigned long allp_pos[MAX_ALLPS];
+    biquad low_pass;
+    biquad high_pass;
+    rev_t wet[REVERB_BLOCK];
+} __attribute__((aligned(ARENA_ALIGN))) TANK_CHANNEL;
 
 typedef struct {
+    TANK_CHANNEL ch[2]; /* L, R */
     unsigned long num_combs; /* total number of comb filters */
     unsigned long num_allps; /* total number of allpass filters */
-    COMB_FILTER * combs;
-    ALLP_FILTER * allps;
-    biquad * low_pass; /* ptr to 2 low-pass filters */
-    biquad * high_pass; /* ptr to 2 high-pass filters */
+    const PRESET_COEFFS * coeffs; /* of the loaded preset */
+    unsigned long tail_delay; /* longest path through the filters (samples) */
+    rev_t * ringbuffers; /* delay line pool, sized for the largest preset */
+    size_t ringbuffers_size; /* bytes of the pool used by the loaded preset */
+
+    float mode; /* preset loaded into the tank, -1 if none */
+    float decay; /* control values the coefficients were computed for */
+    float stereo_enh;
+    int ramping; /* feedback gains are being ramped to a new decay */
+} TANK;
+
+/* message sent to the worker to load a preset into a tank */
+typedef struct {
+    uint32_t tank;
+    uint32_t gen; /* work_gen when it was sent */
+    float mode;
+    float decay;
+    float stereo_enh;
+} TANK_REQUEST;
+
+
+#ifndef REVERB_TABLE_GEN
+#include <pthread.h>
+#include <semaphore.h>
+
+/* The structure used to hold port connection information and state */
+
+typedef struct {
+    const LV2_Descriptor * kernel; /* must come first, see KERNEL() */
+    const PRESET_COEFFS * coeffs; /* NUM_MODES entries */
+    TANK * tanks; /* ptr to 2 tanks */
+    unsigned long active; /* index of the tank being faded in or playing */
+    unsigned long fade_pos; /* samples since the last preset switch */
+    unsigned long fade_len;
+    int work_pending; /* a request is with the worker... */
+    unsigned long work_tank; /* ...loading this tank */
+    uint32_t work_gen; /* bumped by activate(): older responses are stale */
+    LV2_Worker_Schedule * schedule;
     unsigned long sample_rate;
 
     float * decay;
@@ -270,11 +452,33 @@ typedef struct {
     float * input_R;
     float * output_R;
 
-    float old_decay;
-    float old_stereo_enh;
-    float old_mode;
+    /* settings of the current run() call, shared by both channels */
+    unsigned long count;
+    float dry_gain;
+    float wet_gain;
+    float combs_on;
+    float allps_on;
+    float bandpass_on;
+
+    /* silence detection */
+    unsigned long silence; /* samples of silent input in a row */
+    int measure; /* measure the output level in this run() call */
+    int idle; /* the tail has died away: skip the filters */
+    float out_peak[2];
+
+    /* optional helper thread running the right channel */
+    int threaded;
+    int thread_sched; /* 1 if the helper runs at the audio thread's RT
+                         priority, -1 if it could not get it, 0 untried */
+    int thread_job; /* JOB_* */
+    int thread_quit;
+    sem_t thread_go;
+    pthread_t thread;
+
+    rev_t block_in[2][REVERB_BLOCK] __attribute__((aligned(ARENA_ALIGN)));
 
 } Reverb;
+#endif /* REVERB_TABLE_GEN */
 
 typedef struct {
     float delay;
@@ -295,3 +499,50 @@ typedef struct {
     float bandpass_low;
     float bandpass_high;
 } REVERB_DATA;
+
+
+/* compute the coefficients of preset rd at sample rate fs */
+static inline
+void
+preset_coeffs(PRESET_COEFFS * pc, const REVERB_DATA * rd, float fs) {
+
+        unsigned long i;
+        float freq_resp;
+        biquad f;
+
+        memset(pc, 0, sizeof(PRESET_COEFFS));
+
+        for (i = 0; i < rd->num_combs; i++) {
+                pc->comb_buflen[i] = rd->combs[i].delay * fs;
+                freq_resp = LIMIT(rd->combs[i].freq_resp
+                                  * powf(fs / 44100.0f, 0.8f), 0.0f, 1.0f);
+                pc->comb_decay[i] = logf(0.001f) * 1000.0f
+                        * (1 + FR_R_COMP * freq_resp)
+                        / powf(rd->combs[i].feedback / 100.0f, 0.89f) / fs;
+
+                lp_set_params(&f, 2000.0f + 13000.0f * (1 - rd->combs[i].freq_resp)
+                              * fs / 44100.0f, BANDPASS_BWIDTH, fs);
+                pc->comb_lp[i][0] = f.b0;
+                pc->comb_lp[i][1] = f.a1;
+                pc->comb_lp[i][2] = f.a2;
+        }
+
+        for (i = 0; i < rd->num_allps; i++) {
+                pc->allp_buflen[i] = rd->allps[i].delay * fs;
+                pc->allp_decay[i] = logf(0.001f) * 11000.0f
+                        / powf(rd->allps[i].feedback / 100.0f, 0.88f) / fs;
+        }
+
+        lp_set_params(&f, rd->bandpass_high, BANDPASS_BWIDTH, fs);
+        pc->low_pass[0] = f.b0;
+        pc->low_pass[1] = f.b1;
+        pc->low_pass[2] = f.b2;
+        pc->low_pass[3] = f.a1;
+        pc->low_pass[4] = f.a2;
+        hp_set_params(&f, rd->bandpass_low, BANDPASS_BWIDTH, fs);
+        pc->high_pass[0] = f.b0;
+        pc->high_pass[1] = f.b1;
+        pc->high_pass[2] = f.b2;
+        pc->high_pass[3] = f.a1;
+        pc->high_pass[4] = f.a2;
+}
@@ -0,0 +1,201 @@
+/*                                                     -*- linux-c -*-
+    Benchmark of the TAP Reverberator kernels, part of tap-lv2.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+
+/* Benchmark of the three kernels of TAP Reverberator (see the note at
+ * the top of tap_reverb.c), built with "make bench".  Each kernel is fed
+ * a short burst of noise followed by silence, and the time taken per
+ * block is reported for the audible part of the tail (twice the decay
+ * time) and for the silent rest of it.  The silent part is run twice:
+ * once as the plugin runs it, where the idle detection soon skips the
+ * filters, and once with the idle detection off, so that the filters
+ * keep running while their state decays towards denormals.
+ *
+ * usage: tap_reverb_bench [mode [decay [seconds [blocksize]]]]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <lv2.h>
+
+/* the port numbers and presets only, as seen by a float kernel */
+#define REVERB_TABLE_GEN
+#define REVERB_CALC_FP
+typedef float rev_t;
+
+#include "tap_reverb_presets.h"
+
+
+extern const LV2_Descriptor reverb_kernel_fixed;
+extern const LV2_Descriptor reverb_kernel_float;
+extern const LV2_Descriptor reverb_kernel_double;
+
+static const struct {
+    const char * name;
+    const LV2_Descriptor * kernel;
+} kernels[] = {
+    { "fixed", &reverb_kernel_fixed },
+    { "float", &reverb_kernel_float },
+    { "double", &reverb_kernel_double },
+};
+#define NUM_KERNELS (sizeof(kernels) / sizeof(kernels[0]))
+
+#define SAMPLE_RATE 48000
+#define BURST_LEN   2400       /* 50 ms of noise */
+
+/* read by run_Reverb(), see IDLE_ALLOWED */
+int reverb_bench_no_idle;
+
+
+typedef struct {
+    double sum;
+    double max;
+    unsigned long n;
+} STATS;
+
+
+static double
+now(void) {
+
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void
+account(STATS * s, double t) {
+
+    s->sum += t;
+    if (t > s->max)
+        s->max = t;
+    s->n++;
+}
+
+static void
+report(const char * name, const char * part, const STATS * s) {
+
+    printf("%-6s  %-7s  %6lu blocks  %9.2f us/block avg  %9.2f us max\n",
+           name, part, s->n, s->n ? 1e6 * s->sum / s->n : 0.0, 1e6 * s->max);
+}
+
+
+/* run one kernel over the whole input; st[0] gets the blocks of the
+   audible tail, st[1] the silent rest */
+static int
+bench(const LV2_Descriptor * d, float * ctl, float * in_L, float * in_R,
+      float * out_L, float * out_R, unsigned long total,
+      unsigned long audible, unsigned long blocksize, STATS * st) {
+
+    unsigned long pos, i;
+    double t;
+    LV2_Handle h;
+
+    if ((h = d->instantiate(d, SAMPLE_RATE, "", NULL)) == NULL)
+        return -1;
+    for (i = 0; i < INPUT_L; i++)
+        d->connect_port(h, i, ctl + i);
+    d->connect_port(h, OUTPUT_L, out_L);
+    d->connect_port(h, OUTPUT_R, out_R);
+    d->activate(h);
+
+    memset(st, 0, 2 * sizeof(STATS));
+    for (pos = 0; pos < total; pos += blocksize) {
+        d->connect_port(h, INPUT_L, in_L + pos);
+        d->connect_port(h, INPUT_R, in_R + pos);
+        t = now();
+        d->run(h, blocksize);
+        /* the first block loads the preset and is not timed */
+        if (pos > 0)
+            account(st + (pos >= audible), now() - t);
+    }
+
+    d->cleanup(h);
+    return 0;
+}
+
+
+int
+main(int argc, char ** argv) {
+
+    float mode = (argc > 1) ? atof(argv[1]) : 0.0f;
+    float decay = (argc > 2) ? atof(argv[2]) : 2800.0f;
+    float seconds = (argc > 3) ? atof(argv[3]) : 60.0f;
+    unsigned long blocksize = (argc > 4) ? atol(argv[4]) : 256;
+    float ctl[PORTCOUNT_STEREO];
+    float * in_L, * in_R, * out_L, * out_R;
+    unsigned long total, audible, i, k;
+    STATS st[2], st_run[2];
+
+    if (blocksize == 0 || seconds <= 0.0f) {
+        fprintf(stderr, "usage: %s [mode [decay [seconds [blocksize]]]]\n", argv[0]);
+        return 1;
+    }
+
+    total = blocksize + seconds * SAMPLE_RATE;
+    audible = blocksize + BURST_LEN + 2.0f * decay * SAMPLE_RATE / 1000.0f;
+
+    in_L = calloc(total + blocksize, sizeof(float));
+    in_R = calloc(total + blocksize, sizeof(float));
+    out_L = calloc(blocksize, sizeof(float));
+    out_R = calloc(blocksize, sizeof(float));
+    if (!in_L || !in_R || !out_L || !out_R)
+        return 1;
+
+    srand(1);
+    for (i = blocksize; i < blocksize + BURST_LEN && i < total; i++) {
+        in_L[i] = 2.0f * rand() / RAND_MAX - 1.0f;
+        in_R[i] = 2.0f * rand() / RAND_MAX - 1.0f;
+    }
+
+    ctl[DECAY] = decay;
+    ctl[DRYLEVEL] = -4.0f;
+    ctl[WETLEVEL] = -12.0f;
+    ctl[COMBS_EN] = 1.0f;
+    ctl[ALLPS_EN] = 1.0f;
+    ctl[BANDPASS_EN] = 1.0f;
+    ctl[STEREO_ENH] = 1.0f;
+    ctl[MODE] = LIMIT(mode, 0, NUM_MODES - 1);
+
+    printf("mode %g, decay %g ms, %g s at %d Hz, %lu samples per block\n",
+           ctl[MODE], decay, seconds, SAMPLE_RATE, blocksize);
+
+    for (k = 0; k < NUM_KERNELS; k++) {
+        reverb_bench_no_idle = 0;
+        if (bench(kernels[k].kernel, ctl, in_L, in_R, out_L, out_R,
+                  total, audible, blocksize, st) < 0)
+            return 1;
+        reverb_bench_no_idle = 1;
+        if (bench(kernels[k].kernel, ctl, in_L, in_R, out_L, out_R,
+                  total, audible, blocksize, st_run) < 0)
+            return 1;
+
+        report(kernels[k].name, "tail", st);
+        report(kernels[k].name, "idle", st + 1);
+        report(kernels[k].name, "no-idle", st_run + 1);
+    }
+
+    free(in_L);
+    free(in_R);
+    free(out_L);
+    free(out_R);
+    return 0;
+}
@@ -0,0 +1,119 @@
+/*                                                     -*- linux-c -*-
+    Copyright (C) 2004 Tom Szilagyi
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+
+/* Build time generator of tap_reverb_tables.h: the coefficients of
+ * every preset in tap_reverb_presets.h, precomputed for the common
+ * sample rates, so that the plugin only has to look them up.
+ * Run on the build machine, it writes the header to stdout.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#define REVERB_TABLE_GEN
+typedef float rev_t;
+
+#include "tap_reverb_presets.h"
+
+
+static const unsigned long rates[] = { 44100, 48000, 88200, 96000, 192000 };
+#define NUM_RATES (sizeof(rates) / sizeof(rates[0]))
+
+
+/* print a float literal which reads back exactly */
+static void
+print_float(float v) {
+
+    char buf[32];
+
+    snprintf(buf, sizeof(buf), "%.9g", v);
+    printf("%s%sf", buf, strpbrk(buf, ".e") ? "" : ".0");
+}
+
+static void
+print_floats(const float * v, int n) {
+
+    int i;
+
+    printf("{");
+    for (i = 0; i < n; i++) {
+        printf("%s", i ? ", " : "");
+        print_float(v[i]);
+    }
+    printf("}");
+}
+
+static void
+print_uints(const uint32_t * v, int n) {
+
+    int i;
+
+    printf("{");
+    for (i = 0; i < n; i++)
+        printf("%s%u", i ? ", " : "", v[i]);
+    printf("}");
+}
+
+
+int
+main(void) {
+
+    PRESET_COEFFS pc;
+    unsigned long r;
+    int m, i;
+
+    printf("/* Generated by tap_reverb_gen from tap_reverb_presets.h, do not edit. */\n\n");
+
+    for (r = 0; r < NUM_RATES; r++) {
+        printf("static const PRESET_COEFFS preset_coeffs_%lu[NUM_MODES] = {\n",
+               rates[r]);
+        for (m = 0; m < NUM_MODES; m++) {
+            preset_coeffs(&pc, reverb_data + m, rates[r]);
+
+            printf("\t{\n\t\t");
+            print_uints(pc.comb_buflen, MAX_COMBS);
+            printf(",\n\t\t");
+            print_floats(pc.comb_decay, MAX_COMBS);
+            printf(",\n\t\t{");
+            for (i = 0; i < MAX_COMBS; i++) {
+                printf("%s", i ? ", " : "");
+                print_floats(pc.comb_lp[i], 3);
+            }
+            printf("},\n\t\t");
+            print_uints(pc.allp_buflen, MAX_ALLPS);
+            printf(",\n\t\t");
+            print_floats(pc.allp_decay, MAX_ALLPS);
+            printf(",\n\t\t");
+            print_floats(pc.low_pass, 5);
+            printf(",\n\t\t");
+            print_floats(pc.high_pass, 5);
+            printf(",\n\t},\n");
+        }
+        printf("};\n\n");
+    }
+
+    printf("const PRESET_TABLE preset_tables[] = {\n");
+    for (r = 0; r < NUM_RATES; r++)
+        printf("\t{%lu, preset_coeffs_%lu},\n", rates[r], rates[r]);
+    printf("\t{0, NULL}\n};\n");
+
+    return 0;
+}
@@ -29,6 +29,10 @@
 
 
 /* Reverb Type data */
+#ifdef REVERB_CALC_FP
+/* defined once, in the fixed kernel */
+extern REVERB_DATA reverb_data[NUM_MODES];
+#else
 REVERB_DATA reverb_data[NUM_MODES] = {
         {
                 5,
@@ -911,4 +915,4 @@ REVERB_DATA reverb_data[NUM_MODES] = {
                 10000.0f,
         },
 };
-
+#endif /* REVERB_CALC_FP */
@@ -41,21 +41,35 @@
 #define INPUT_R         6
 #define OUTPUT_L        7
 #define OUTPUT_R        8
+#define SPEED           9
+#define OUTMODE        10
+#define ADDGAIN        11
 
 
 /* Total number of ports */
 
-#define PORTCOUNT_STEREO   9
+#define PORTCOUNT_STEREO   12
 
 /*
- * This has to be bigger than 0.3f * sample_rate / (2*PI) for any sample rate.
- * At 192 kHz 9168 is needed so this should be enough.
+ * Length of the delay lines, the latency is half of it.
+ * At 192 kHz this is 18335, so the latency stays below 9200.
  */
-#define PM_DEPTH 9200
+#define PM_BUFLEN(sample_rate) ((unsigned long)ceil(0.3f * (sample_rate) / M_PI))
+
+/* The four lines share one block, each starting on a cache line. */
+#define PM_ALIGN 64
+#define PM_STRIDE(buflen) \
+        (((buflen) + FDELAY_GUARD + PM_ALIGN / sizeof(float) - 1) & \
+         ~(PM_ALIGN / sizeof(float) - 1))
 
 /* maximum phase mod freq */
 #define PM_FREQ 30.0f
 
+/* interpolation of the modulated delay lines */
+#ifndef PM_INTERP
+#define PM_INTERP FDELAY_HERMITE
+#endif
+
 
 /* splitting input signals into low and high freq components */
 #define SPLIT_FREQ 1000.0f
@@ -68,9 +82,41 @@
 /* coefficient between rotating frequency and pitch mod depth (aka. Doppler effect) */
 #define FREQ_PITCH 1.6f
 
-/* cosine table for fast computations */
-float cos_table[1024];
-int flagcos = 0;
+/* settings of the speed switch; manual follows the frequency controls */
+#define SPEED_MANUAL 0
+#define SPEED_SLOW   1
+#define SPEED_FAST   2
+
+/* how the output buffers are written: the add modes sum into what
+   the host left in them, e.g. a bus shared by several instances */
+#define OUT_REPLACE  0
+#define OUT_ADD      1
+#define OUT_ADD_GAIN 2
+
+/* chorale and tremolo rotor frequencies [Hz] */
+#define HORN_SLOW 0.8f
+#define HORN_FAST 6.7f
+#define BASS_SLOW 0.7f
+#define BASS_FAST 5.8f
+
+/* Rotor inertia: time constants [s] of speeding up and slowing down.
+   The light horn settles within a second, the heavy drum takes several. */
+#define HORN_ACCEL 0.3f
+#define HORN_DECEL 0.5f
+#define BASS_ACCEL 1.5f
+#define BASS_DECEL 2.0f
+
+/* The rotor phases are 32 bit fixed-point, one turn wraps around to 0;
+   the top COS_TABLE_BITS index the table. */
+#define COS_TABLE_BITS 10
+#define COS_TABLE_SIZE (1 << COS_TABLE_BITS)
+#define PHASE_SHIFT (32 - COS_TABLE_BITS)
+#define PHASE_ONE 4294967296.0
+
+/* cosine and sine table for fast computations: one read gives the
+   rotor position in quadrature, the right channel is opposite to it */
+static float cos_table[COS_TABLE_SIZE][2];
+static int flagcos = 0;
 
 
 /* The structure used to hold port connection information and state */
@@ -85,20 +131,14 @@ typedef struct {
     float * input_R;
     float * output_L;
     float * output_R;
+    float * speed;
+    float * outmode;
+    float * addgain;
 
-        float * ringbuffer_h_L;
-        unsigned long buflen_h_L;
-        unsigned long pos_h_L;
-        float * ringbuffer_h_R;
-        unsigned long buflen_h_R;
-        unsigned long pos_h_R;
-
-        float * ringbuffer_b_L;
-        unsigned long buflen_b_L;
-        unsigned long pos_b_L;
-        float * ringbuffer_b_R;
-        unsigned long buflen_b_R;
-        unsigned long pos_b_R;
+        /* horn L, horn R, bass L, bass R */
+        float * delay_mem;
+        fdelay line[4];
+        float interp_state[4];
 
     biquad * eq_filter_L;
     biquad * lp_filter_L;
@@ -109,13 +149,39 @@ typedef struct {
     biquad * hp_filter_R;
 
     unsigned long sample_rate;
-    float phase_h;
-    float phase_b;
+    uint32_t phase_h;
+    uint32_t phase_b;
+
+        /* current rotor frequencies and the per sample decay of their
+           distance from the target, when speeding up or slowing down */
+        float freq_h;
+        float freq_b;
+        float accel_h, decel_h;
+        float accel_b, decel_b;
 
-    float run_adding_gain;
 } RotSpkr;
 
 
+/* per sample decay of a one-pole ramp with time constant tau [s] */
+static inline
+float
+ramp_decay(float tau, double sample_rate) {
+
+        return expf(-1.0f / (tau * sample_rate));
+}
+
+
+/* Doppler pitch mod depth of a rotor turning at freq, at most maxdepth */
+static inline
+float
+rotor_depth(float freq, float sample_rate, float maxdepth) {
+
+        float d = freq * (1.0f + FREQ_PITCH * freq / C_AIR) * 200.0f * M_PI;
+
+        return (d * maxdepth > sample_rate) ? sample_rate / d : maxdepth;
+}
+
+
 
 /* Construct a new plugin instance. */
 LV2_Handle
@@ -126,37 +192,35 @@ instantiate_RotSpkr(const LV2_Descriptor * Descriptor, double SampleRate, const
 
     if(flagcos == 0)
     {
-        for (i = 0; i < 1024; i++)
-        cos_table[i] = cosf(i * M_PI / 512.0f);
+        for (i = 0; i < COS_TABLE_SIZE; i++) {
+        cos_table[i][0] = cosf(i * 2.0f * M_PI / COS_TABLE_SIZE);
+        cos_table[i][1] = sinf(i * 2.0f * M_PI / COS_TABLE_SIZE);
+        }
         flagcos++;
     }
 
 
     if ((ptr = malloc(sizeof(RotSpkr))) != NULL) {
         ((RotSpkr *)ptr)->sample_rate = SampleRate;
-        ((RotSpkr *)ptr)->run_adding_gain = 1.0;
-
-                if ((((RotSpkr *)ptr)->ringbuffer_h_L =
-                     calloc(2 * PM_DEPTH, sizeof(float))) == NULL)
-                        return NULL;
-                if ((((RotSpkr *)ptr)->ringbuffer_h_R =
-                     calloc(2 * PM_DEPTH, sizeof(float))) == NULL)
-                        return NULL;
-                ((RotSpkr *)ptr)->buflen_h_L = ceil(0.3f * SampleRate / M_PI);
-                ((RotSpkr *)ptr)->buflen_h_R = ceil(0.3f * SampleRate / M_PI);
-                ((RotSpkr *)ptr)->pos_h_L = 0;
-                ((RotSpkr *)ptr)->pos_h_R = 0;
-
-                if ((((RotSpkr *)ptr)->ringbuffer_b_L =
-                     calloc(2 * PM_DEPTH, sizeof(float))) == NULL)
-                        return NULL;
-                if ((((RotSpkr *)ptr)->ringbuffer_b_R =
-                     calloc(2 * PM_DEPTH, sizeof(float))) == NULL)
+        ((RotSpkr *)ptr)->outmode = NULL;
+        ((RotSpkr *)ptr)->addgain = NULL;
+        ((RotSpkr *)ptr)->accel_h = ramp_decay(HORN_ACCEL, SampleRate);
+        ((RotSpkr *)ptr)->decel_h = ramp_decay(HORN_DECEL, SampleRate);
+        ((RotSpkr *)ptr)->accel_b = ramp_decay(BASS_ACCEL, SampleRate);
+        ((RotSpkr *)ptr)->decel_b = ramp_decay(BASS_DECEL, SampleRate);
+
+        {
+                unsigned long buflen = PM_BUFLEN(SampleRate);
+                unsigned long stride = PM_STRIDE(buflen);
+                float * mem;
+
+                if (posix_memalign((void **)&mem, PM_ALIGN,
+                                   4 * stride * sizeof(float)) != 0)
                         return NULL;
-                ((RotSpkr *)ptr)->buflen_b_L = ceil(0.3f * SampleRate / M_PI);
-                ((RotSpkr *)ptr)->buflen_b_R = ceil(0.3f * SampleRate / M_PI);
-                ((RotSpkr *)ptr)->pos_b_L = 0;
-                ((RotSpkr *)ptr)->pos_b_R = 0;
+                ((RotSpkr *)ptr)->delay_mem = mem;
+                for (i = 0; i < 4; i++)
+                        fdelay_init(&((RotSpkr *)ptr)->line[i], mem + i * stride, buflen);
+        }
 
         if ((((RotSpkr *)ptr)->eq_filter_L = calloc(1, sizeof(biquad))) == NULL)
             return NULL;
@@ -186,15 +250,15 @@ activate_RotSpkr(LV2_Handle Instance) {
 
     ptr = (RotSpkr *)Instance;
 
-    for (i = 0; i < 2 * PM_DEPTH; i++) {
-        ptr->ringbuffer_h_L[i] = 0.0f;
-        ptr->ringbuffer_h_R[i] = 0.0f;
-        ptr->ringbuffer_b_L[i] = 0.0f;
-        ptr->ringbuffer_b_R[i] = 0.0f;
+    for (i = 0; i < 4; i++) {
+        fdelay_clear(&ptr->line[i]);
+        ptr->interp_state[i] = 0.0f;
     }
 
-    ptr->phase_h = 0.0f;
-    ptr->phase_b = 0.0f;
+    ptr->phase_h = 0;
+    ptr->phase_b = 0;
+    ptr->freq_h = -1.0f;
+    ptr->freq_b = -1.0f;
 
     biquad_init(ptr->eq_filter_L);
     biquad_init(ptr->lp_filter_L);
@@ -251,51 +315,101 @@ connect_port_RotSpkr(LV2_Handle Instance,
     case OUTPUT_R:
         ptr->output_R = (float *) DataLocation;
         break;
+    case SPEED:
+        ptr->speed = (float *) DataLocation;
+        break;
+    case OUTMODE:
+        ptr->outmode = (float *) DataLocation;
+        break;
+    case ADDGAIN:
+        ptr->addgain = (float *) DataLocation;
+        break;
     }
 }
 
 
-
+static inline __attribute__((always_inline))
 void
-run_RotSpkr(LV2_Handle Instance,
-        uint32_t SampleCount) {
+write_output(float * out, float x, const int outmode, const float gain) {
+
+        if (outmode == OUT_REPLACE)
+                *out = x;
+        else if (outmode == OUT_ADD)
+                *out += x;
+        else
+                *out += gain * x;
+}
 
 
-    RotSpkr * ptr = (RotSpkr *)Instance;
+/* The processing core.  It is inlined into run_RotSpkr() once for each
+   output mode, so the inner loop has no per sample branch on it. */
+static inline __attribute__((always_inline))
+void
+process_RotSpkr(RotSpkr * ptr, uint32_t SampleCount,
+                const int outmode, const float gain) {
 
     float * input_L = ptr->input_L;
     float * input_R = ptr->input_R;
     float * output_L = ptr->output_L;
     float * output_R = ptr->output_R;
-    float freq_h = LIMIT(*(ptr->hornfreq),0.0f,PM_FREQ);
-    float freq_b = LIMIT(*(ptr->bassfreq),0.0f,PM_FREQ);
+    float target_h = LIMIT(*(ptr->hornfreq),0.0f,PM_FREQ);
+    float target_b = LIMIT(*(ptr->bassfreq),0.0f,PM_FREQ);
     float stwidth = LIMIT(*(ptr->stwidth),0.0f,100.0f);
     float hrbal = LIMIT(*(ptr->hrbal),0.0f,1.0f);
-    float pmdepth_h =
-        LIMIT(1.0f/(1.0f+FREQ_PITCH*freq_h/C_AIR) * ptr->sample_rate
-              / 200.0f / M_PI / freq_h, 0, ptr->buflen_h_L / 2);
-    float pmdepth_b =
-        LIMIT(1.0f/(1.0f+FREQ_PITCH*freq_b/C_AIR) * ptr->sample_rate
-              / 200.0f / M_PI / freq_b, 0, ptr->buflen_b_L / 2);
+    int speed = LIMIT(*(ptr->speed),0.0f,2.0f) + 0.5f;
     unsigned long sample_index;
 
     float in_L = 0.0f, in_R = 0.0f;
     float lo_L = 0.0f, lo_R = 0.0f;
     float hi_L = 0.0f, hi_R = 0.0f;
 
-    float phase_h_L = 0.0f, phase_b_L = 0.0f;
-    float phase_h_R = 0.0f, phase_b_R = 0.0f;
-    float phase_pm_h_L = 0.0f, phase_pm_b_L = 0.0f;
-    float phase_pm_h_R = 0.0f, phase_pm_b_R = 0.0f;
-    float pm_h_L = 0.0f, pm_b_L = 0.0f;
-    float pm_h_R = 0.0f, pm_b_R = 0.0f;
-
-    float fpos_h_L = 0.0f, fpos_b_L = 0.0f, fpos_h_R = 0.0f, fpos_b_R = 0.0f;
-    float n_h_L = 0.0f, n_b_L = 0.0f, n_h_R = 0.0f, n_b_R = 0.0f;
-    float rem_h_L = 0.0f, rem_b_L = 0.0f, rem_h_R = 0.0f, rem_b_R = 0.0f;
-    float sa_h_L = 0.0f, sa_b_L = 0.0f, sb_h_L = 0.0f, sb_b_L = 0.0f;
-    float sa_h_R = 0.0f, sa_b_R = 0.0f, sb_h_R = 0.0f, sb_b_R = 0.0f;
+    uint32_t phase_h = ptr->phase_h;
+    uint32_t phase_b = ptr->phase_b;
+    float freq_h, freq_b;
+    float err_h, err_b;
+    float k_h, k_b;
+    float pmdepth_h, pmdepth_b;
+    float dstep_h, dstep_b;
+    const float phase_scale = PHASE_ONE / ptr->sample_rate;
+    const float maxdepth_h = ptr->line[0].buflen / 2;
+    const float maxdepth_b = ptr->line[2].buflen / 2;
+    const float * cs_h;
+    const float * cs_b;
+    const fdelay * const lines[4] = { &ptr->line[0], &ptr->line[1], &ptr->line[2], &ptr->line[3] };
+    float fpos[4];
+    v4sf pm;
+
+    if (speed == SPEED_SLOW) {
+        target_h = HORN_SLOW;
+        target_b = BASS_SLOW;
+    } else if (speed == SPEED_FAST) {
+        target_h = HORN_FAST;
+        target_b = BASS_FAST;
+    }
 
+    /* the first run after activation starts at speed */
+    if (ptr->freq_h < 0.0f) {
+        ptr->freq_h = target_h;
+        ptr->freq_b = target_b;
+    }
+    /* the distance is ramped rather than the frequency, so the last
+       steps are not lost to rounding near the target */
+    err_h = ptr->freq_h - target_h;
+    err_b = ptr->freq_b - target_b;
+    k_h = (err_h < 0.0f) ? ptr->accel_h : ptr->decel_h;
+    k_b = (err_b < 0.0f) ? ptr->accel_b : ptr->decel_b;
+
+    /* the depth only follows the rotor speed, so it is evaluated at
+       both ends of the block and ramped linearly in between */
+    pmdepth_h = rotor_depth(ptr->freq_h, ptr->sample_rate, maxdepth_h);
+    pmdepth_b = rotor_depth(ptr->freq_b, ptr->sample_rate, maxdepth_b);
+    dstep_h = dstep_b = 0.0f;
+    if (SampleCount) {
+        float end_h = target_h + err_h * powf(k_h, SampleCount);
+        float end_b = target_b + err_b * powf(k_b, SampleCount);
+        dstep_h = (rotor_depth(end_h, ptr->sample_rate, maxdepth_h) - pmdepth_h) / SampleCount;
+        dstep_b = (rotor_depth(end_b, ptr->sample_rate, maxdepth_b) - pmdepth_b) / SampleCount;
+    }
 
     for (sample_index = 0; sample_index < SampleCount; sample_index++) {
 
@@ -310,266 +424,78 @@ run_RotSpkr(LV2_Handle Instance,
         hi_R = biquad_run(ptr->hp_filter_R, in_R);
 
 
-        phase_h_L = 1024.0f * freq_h * sample_index / ptr->sample_rate + ptr->phase_h;
-        while (phase_h_L >= 1024.0f)
-                phase_h_L -= 1024.0f;
-        phase_pm_h_L = phase_h_L + 256.0f;
-        while (phase_pm_h_L >= 1024.0f)
-            phase_pm_h_L -= 1024.0f;
-        phase_h_R = phase_h_L + 512.0f;
-        while (phase_h_R >= 1024.0f)
-                phase_h_R -= 1024.0f;
-        phase_pm_h_R = phase_h_R + 256.0f;
-        while (phase_pm_h_R >= 1024.0f)
-            phase_pm_h_R -= 1024.0f;
-
-        phase_b_L = 1024.0f * freq_b * sample_index / ptr->sample_rate + ptr->phase_b;
-        while (phase_b_L >= 1024.0f)
-                phase_b_L -= 1024.0f;
-        phase_pm_b_L = phase_b_L + 256.0f;
-        while (phase_pm_b_L >= 1024.0f)
-            phase_pm_b_L -= 1024.0f;
-        phase_b_R = phase_b_L + 512.0f;
-        while (phase_b_R >= 1024.0f)
-                phase_b_R -= 1024.0f;
-        phase_pm_b_R = phase_b_R + 256.0f;
-        while (phase_pm_b_R >= 1024.0f)
-            phase_pm_b_R -= 1024.0f;
-
-                push_buffer(hi_L, ptr->ringbuffer_h_L, ptr->buflen_h_L, &(ptr->pos_h_L));
-                push_buffer(hi_R, ptr->ringbuffer_h_R, ptr->buflen_h_R, &(ptr->pos_h_R));
-                push_buffer(lo_L, ptr->ringbuffer_b_L, ptr->buflen_b_L, &(ptr->pos_b_L));
-                push_buffer(lo_R, ptr->ringbuffer_b_R, ptr->buflen_b_R, &(ptr->pos_b_R));
-
-                fpos_h_L = pmdepth_h * (1.0f - cos_table[(unsigned long) phase_pm_h_L]);
-                n_h_L = floorf(fpos_h_L);
-                rem_h_L = fpos_h_L - n_h_L;
-                sa_h_L = read_buffer(ptr->ringbuffer_h_L,
-                     ptr->buflen_h_L, ptr->pos_h_L, (unsigned long) n_h_L);
-                sb_h_L = read_buffer(ptr->ringbuffer_h_L,
-                     ptr->buflen_h_L, ptr->pos_h_L, (unsigned long) n_h_L + 1);
-                pm_h_L = (1 - rem_h_L) * sa_h_L + rem_h_L * sb_h_L;
-
-                fpos_h_R = pmdepth_h * (1.0f - cos_table[(unsigned long) phase_pm_h_R]);
-                n_h_R = floorf(fpos_h_R);
-                rem_h_R = fpos_h_R - n_h_R;
-                sa_h_R = read_buffer(ptr->ringbuffer_h_R,
-                     ptr->buflen_h_R, ptr->pos_h_R, (unsigned long) n_h_R);
-                sb_h_R = read_buffer(ptr->ringbuffer_h_R,
-                     ptr->buflen_h_R, ptr->pos_h_R, (unsigned long) n_h_R + 1);
-                pm_h_R = (1 - rem_h_R) * sa_h_R + rem_h_R * sb_h_R;
-
-
-                fpos_b_L = pmdepth_b * (1.0f - cos_table[(unsigned long) phase_pm_b_L]);
-                n_b_L = floorf(fpos_b_L);
-                rem_b_L = fpos_b_L - n_b_L;
-                sa_b_L = read_buffer(ptr->ringbuffer_b_L,
-                     ptr->buflen_b_L, ptr->pos_b_L, (unsigned long) n_b_L);
-                sb_b_L = read_buffer(ptr->ringbuffer_b_L,
-                     ptr->buflen_b_L, ptr->pos_b_L, (unsigned long) n_b_L + 1);
-                pm_b_L = (1 - rem_b_L) * sa_b_L + rem_b_L * sb_b_L;
-
-                fpos_b_R = pmdepth_b * (1.0f - cos_table[(unsigned long) phase_pm_b_R]);
-                n_b_R = floorf(fpos_b_R);
-                rem_b_R = fpos_b_R - n_b_R;
-                sa_b_R = read_buffer(ptr->ringbuffer_b_R,
-                     ptr->buflen_b_R, ptr->pos_b_R, (unsigned long) n_b_R);
-                sb_b_R = read_buffer(ptr->ringbuffer_b_R,
-                     ptr->buflen_b_R, ptr->pos_b_R, (unsigned long) n_b_R + 1);
-                pm_b_R = (1 - rem_b_R) * sa_b_R + rem_b_R * sb_b_R;
-
-
-        *(output_L++) =
-            hrbal * pm_h_L * (1.0f + 0.5f * stwidth/100.0f *
-                      cos_table[(unsigned long) phase_h_L]) +
-            (1.0f - hrbal) * pm_b_L * (1.0f + 0.5f * stwidth/100.0f *
-                           cos_table[(unsigned long) phase_b_L]);
-
-        *(output_R++) =
-            hrbal * pm_h_R * (1.0f + 0.5f * stwidth/100.0f *
-                      cos_table[(unsigned long) phase_h_R]) +
-            (1.0f - hrbal) * pm_b_R * (1.0f + 0.5f * stwidth/100.0f *
-                           cos_table[(unsigned long) phase_b_R]);
+        /* cos of the rotor angle modulates the amplitude, the pitch
+           modulation runs a quarter turn ahead of it (-sin) */
+        cs_h = cos_table[phase_h >> PHASE_SHIFT];
+        cs_b = cos_table[phase_b >> PHASE_SHIFT];
+        err_h *= k_h;
+        err_b *= k_b;
+        freq_h = target_h + err_h;
+        freq_b = target_b + err_b;
+        phase_h += (uint32_t)(freq_h * phase_scale);
+        phase_b += (uint32_t)(freq_b * phase_scale);
+        pmdepth_h += dstep_h;
+        pmdepth_b += dstep_b;
+
+                fdelay_push(&ptr->line[0], hi_L);
+                fdelay_push(&ptr->line[1], hi_R);
+                fdelay_push(&ptr->line[2], lo_L);
+                fdelay_push(&ptr->line[3], lo_R);
+
+                fpos[0] = pmdepth_h * (1.0f + cs_h[1]);
+                fpos[1] = pmdepth_h * (1.0f - cs_h[1]);
+                fpos[2] = pmdepth_b * (1.0f + cs_b[1]);
+                fpos[3] = pmdepth_b * (1.0f - cs_b[1]);
+                pm = fdelay_read_frac4(lines, fpos, PM_INTERP, ptr->interp_state);
+
+        write_output(output_L++,
+            hrbal * pm[0] * (1.0f + 0.5f * stwidth/100.0f * cs_h[0]) +
+            (1.0f - hrbal) * pm[2] * (1.0f + 0.5f * stwidth/100.0f * cs_b[0]),
+            outmode, gain);
+
+        write_output(output_R++,
+            hrbal * pm[1] * (1.0f - 0.5f * stwidth/100.0f * cs_h[0]) +
+            (1.0f - hrbal) * pm[3] * (1.0f - 0.5f * stwidth/100.0f * cs_b[0]),
+            outmode, gain);
     }
 
-        ptr->phase_h += 1024.0f * freq_h * sample_index / ptr->sample_rate;
-        while (ptr->phase_h >= 1024.0f)
-        ptr->phase_h -= 1024.0f;
-        ptr->phase_b += 1024.0f * freq_b * sample_index / ptr->sample_rate;
-        while (ptr->phase_b >= 1024.0f)
-        ptr->phase_b -= 1024.0f;
+        ptr->phase_h = phase_h;
+        ptr->phase_b = phase_b;
 
-    *(ptr->latency) = ptr->buflen_h_L / 2;
-}
+        /* settle instead of crawling into denormals */
+        ptr->freq_h = target_h + ((fabsf(err_h) < 1e-4f) ? 0.0f : err_h);
+        ptr->freq_b = target_b + ((fabsf(err_b) < 1e-4f) ? 0.0f : err_b);
 
-
-void
-set_run_adding_gain_RotSpkr(LV2_Handle Instance, float gain) {
-
-    RotSpkr * ptr = (RotSpkr *)Instance;
-
-    ptr->run_adding_gain = gain;
+    *(ptr->latency) = ptr->line[0].buflen / 2;
 }
 
 
-
 void
-run_adding_RotSpkr(LV2_Handle Instance,
-           unsigned long SampleCount) {
+run_RotSpkr(LV2_Handle Instance,
+        uint32_t SampleCount) {
 
     RotSpkr * ptr = (RotSpkr *)Instance;
 
-    float * input_L = ptr->input_L;
-    float * input_R = ptr->input_R;
-    float * output_L = ptr->output_L;
-    float * output_R = ptr->output_R;
-    float freq_h = LIMIT(*(ptr->hornfreq),0.0f,PM_FREQ);
-    float freq_b = LIMIT(*(ptr->bassfreq),0.0f,PM_FREQ);
-    float stwidth = LIMIT(*(ptr->stwidth),0.0f,100.0f);
-    float hrbal = LIMIT(*(ptr->hrbal),0.0f,1.0f);
-    float pmdepth_h =
-        LIMIT(1.0f/(1.0f+FREQ_PITCH*freq_h/C_AIR) * ptr->sample_rate
-              / 200.0f / M_PI / freq_h, 0, ptr->buflen_h_L / 2);
-    float pmdepth_b =
-        LIMIT(1.0f/(1.0f+FREQ_PITCH*freq_b/C_AIR) * ptr->sample_rate
-              / 200.0f / M_PI / freq_b, 0, ptr->buflen_b_L / 2);
-    unsigned long sample_index;
-
-    float in_L = 0.0f, in_R = 0.0f;
-    float lo_L = 0.0f, lo_R = 0.0f;
-    float hi_L = 0.0f, hi_R = 0.0f;
-
-    float phase_h_L = 0.0f, phase_b_L = 0.0f;
-    float phase_h_R = 0.0f, phase_b_R = 0.0f;
-    float phase_pm_h_L = 0.0f, phase_pm_b_L = 0.0f;
-    float phase_pm_h_R = 0.0f, phase_pm_b_R = 0.0f;
-    float pm_h_L = 0.0f, pm_b_L = 0.0f;
-    float pm_h_R = 0.0f, pm_b_R = 0.0f;
-
-    float fpos_h_L = 0.0f, fpos_b_L = 0.0f, fpos_h_R = 0.0f, fpos_b_R = 0.0f;
-    float n_h_L = 0.0f, n_b_L = 0.0f, n_h_R = 0.0f, n_b_R = 0.0f;
-    float rem_h_L = 0.0f, rem_b_L = 0.0f, rem_h_R = 0.0f, rem_b_R = 0.0f;
-    float sa_h_L = 0.0f, sa_b_L = 0.0f, sb_h_L = 0.0f, sb_b_L = 0.0f;
-    float sa_h_R = 0.0f, sa_b_R = 0.0f, sb_h_R = 0.0f, sb_b_R = 0.0f;
-
+    /* both ports are optional, unconnected means replacing */
+    int outmode = ptr->outmode ? LIMIT(*(ptr->outmode),0.0f,1.0f) + 0.5f : OUT_REPLACE;
+    float gain = ptr->addgain ? LIMIT(*(ptr->addgain),0.0f,1.0f) : 1.0f;
 
-    for (sample_index = 0; sample_index < SampleCount; sample_index++) {
-
-        in_L = *(input_L++);
-        in_R = *(input_R++);
-
-        in_L = biquad_run(ptr->eq_filter_L, in_L);
-        in_R = biquad_run(ptr->eq_filter_R, in_R);
-        lo_L = biquad_run(ptr->lp_filter_L, in_L);
-        lo_R = biquad_run(ptr->lp_filter_R, in_R);
-        hi_L = biquad_run(ptr->hp_filter_L, in_L);
-        hi_R = biquad_run(ptr->hp_filter_R, in_R);
-
-
-        phase_h_L = 1024.0f * freq_h * sample_index / ptr->sample_rate + ptr->phase_h;
-        while (phase_h_L >= 1024.0f)
-                phase_h_L -= 1024.0f;
-        phase_pm_h_L = phase_h_L + 256.0f;
-        while (phase_pm_h_L >= 1024.0f)
-            phase_pm_h_L -= 1024.0f;
-        phase_h_R = phase_h_L + 512.0f;
-        while (phase_h_R >= 1024.0f)
-                phase_h_R -= 1024.0f;
-        phase_pm_h_R = phase_h_R + 256.0f;
-        while (phase_pm_h_R >= 1024.0f)
-            phase_pm_h_R -= 1024.0f;
-
-        phase_b_L = 1024.0f * freq_b * sample_index / ptr->sample_rate + ptr->phase_b;
-        while (phase_b_L >= 1024.0f)
-                phase_b_L -= 1024.0f;
-        phase_pm_b_L = phase_b_L + 256.0f;
-        while (phase_pm_b_L >= 1024.0f)
-            phase_pm_b_L -= 1024.0f;
-        phase_b_R = phase_b_L + 512.0f;
-        while (phase_b_R >= 1024.0f)
-                phase_b_R -= 1024.0f;
-        phase_pm_b_R = phase_b_R + 256.0f;
-        while (phase_pm_b_R >= 1024.0f)
-            phase_pm_b_R -= 1024.0f;
-
-                push_buffer(hi_L, ptr->ringbuffer_h_L, ptr->buflen_h_L, &(ptr->pos_h_L));
-                push_buffer(hi_R, ptr->ringbuffer_h_R, ptr->buflen_h_R, &(ptr->pos_h_R));
-                push_buffer(lo_L, ptr->ringbuffer_b_L, ptr->buflen_b_L, &(ptr->pos_b_L));
-                push_buffer(lo_R, ptr->ringbuffer_b_R, ptr->buflen_b_R, &(ptr->pos_b_R));
-
-                fpos_h_L = pmdepth_h * (1.0f - cos_table[(unsigned long) phase_pm_h_L]);
-                n_h_L = floorf(fpos_h_L);
-                rem_h_L = fpos_h_L - n_h_L;
-                sa_h_L = read_buffer(ptr->ringbuffer_h_L,
-                     ptr->buflen_h_L, ptr->pos_h_L, (unsigned long) n_h_L);
-                sb_h_L = read_buffer(ptr->ringbuffer_h_L,
-                     ptr->buflen_h_L, ptr->pos_h_L, (unsigned long) n_h_L + 1);
-                pm_h_L = (1 - rem_h_L) * sa_h_L + rem_h_L * sb_h_L;
-
-                fpos_h_R = pmdepth_h * (1.0f - cos_table[(unsigned long) phase_pm_h_R]);
-                n_h_R = floorf(fpos_h_R);
-                rem_h_R = fpos_h_R - n_h_R;
-                sa_h_R = read_buffer(ptr->ringbuffer_h_R,
-                     ptr->buflen_h_R, ptr->pos_h_R, (unsigned long) n_h_R);
-                sb_h_R = read_buffer(ptr->ringbuffer_h_R,
-                     ptr->buflen_h_R, ptr->pos_h_R, (unsigned long) n_h_R + 1);
-                pm_h_R = (1 - rem_h_R) * sa_h_R + rem_h_R * sb_h_R;
-
-
-                fpos_b_L = pmdepth_b * (1.0f - cos_table[(unsigned long) phase_pm_b_L]);
-                n_b_L = floorf(fpos_b_L);
-                rem_b_L = fpos_b_L - n_b_L;
-                sa_b_L = read_buffer(ptr->ringbuffer_b_L,
-                     ptr->buflen_b_L, ptr->pos_b_L, (unsigned long) n_b_L);
-                sb_b_L = read_buffer(ptr->ringbuffer_b_L,
-                     ptr->buflen_b_L, ptr->pos_b_L, (unsigned long) n_b_L + 1);
-                pm_b_L = (1 - rem_b_L) * sa_b_L + rem_b_L * sb_b_L;
-
-                fpos_b_R = pmdepth_b * (1.0f - cos_table[(unsigned long) phase_pm_b_R]);
-                n_b_R = floorf(fpos_b_R);
-                rem_b_R = fpos_b_R - n_b_R;
-                sa_b_R = read_buffer(ptr->ringbuffer_b_R,
-                     ptr->buflen_b_R, ptr->pos_b_R, (unsigned long) n_b_R);
-                sb_b_R = read_buffer(ptr->ringbuffer_b_R,
-                     ptr->buflen_b_R, ptr->pos_b_R, (unsigned long) n_b_R + 1);
-                pm_b_R = (1 - rem_b_R) * sa_b_R + rem_b_R * sb_b_R;
-
-
-        *(output_L++) += ptr->run_adding_gain *
-            hrbal * pm_h_L * (1.0f + 0.5f * stwidth/100.0f *
-                      cos_table[(unsigned long) phase_h_L]) +
-            (1.0f - hrbal) * pm_b_L * (1.0f + 0.5f * stwidth/100.0f *
-                           cos_table[(unsigned long) phase_b_L]);
-
-        *(output_R++) += ptr->run_adding_gain *
-            hrbal * pm_h_R * (1.0f + 0.5f * stwidth/100.0f *
-                      cos_table[(unsigned long) phase_h_R]) +
-            (1.0f - hrbal) * pm_b_R * (1.0f + 0.5f * stwidth/100.0f *
-                           cos_table[(unsigned long) phase_b_R]);
-    }
-
-        ptr->phase_h += 1024.0f * freq_h * sample_index / ptr->sample_rate;
-        while (ptr->phase_h >= 1024.0f)
-        ptr->phase_h -= 1024.0f;
-        ptr->phase_b += 1024.0f * freq_b * sample_index / ptr->sample_rate;
-        while (ptr->phase_b >= 1024.0f)
-        ptr->phase_b -= 1024.0f;
-
-    *(ptr->latency) = ptr->buflen_h_L / 2;
+    if (outmode == OUT_REPLACE)
+        process_RotSpkr(ptr, SampleCount, OUT_REPLACE, 1.0f);
+    else if (gain == 1.0f)
+        process_RotSpkr(ptr, SampleCount, OUT_ADD, 1.0f);
+    else
+        process_RotSpkr(ptr, SampleCount, OUT_ADD_GAIN, gain);
 }
 
 
-
 /* Throw away an RotSpkr effect instance. */
 void
 cleanup_RotSpkr(LV2_Handle Instance) {
 
         RotSpkr * ptr = (RotSpkr *)Instance;
 
-    free(ptr->ringbuffer_h_L);
-    free(ptr->ringbuffer_h_R);
-    free(ptr->ringbuffer_b_L);
-    free(ptr->ringbuffer_b_R);
+    free(ptr->delay_mem);
     free(ptr->eq_filter_L);
     free(ptr->eq_filter_R);
     free(ptr->lp_filter_L);
@@ -23,6 +23,7 @@
 
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
 
 #ifndef M_PI
 #define M_PI 3.14159265358979323846264338327
@@ -204,6 +205,26 @@ a2 = 1 - alpha;
 }
 
 
+/* second order allpass, with the poles of the lp/hp filters above */
+static inline
+void
+ap_set_params(biquad *f, bq_t fc, bq_t bw, bq_t fs)
+{
+	bq_t omega = 2.0 * M_PI * fc/fs;
+	bq_t sn = sin(omega);
+	bq_t cs = cos(omega);
+	bq_t alpha = sn * sinh(M_LN2 / 2.0 * bw * omega / sn);
+
+	const float a0r = 1.0 / (1.0 + alpha);
+
+	f->b0 = a0r * (1.0 - alpha);
+	f->b1 = a0r * -(2.0 * cs);
+	f->b2 = 1.0;
+	f->a1 = a0r * (2.0 * cs);
+	f->a2 = a0r * (alpha - 1.0);
+}
+
+
 static inline
 void
 ls_set_params(biquad *f, bq_t fc, bq_t gain, bq_t slope, bq_t fs)
@@ -271,3 +292,203 @@ biquad_run(biquad *f, bq_t x) {
 
 	return u.y;
 }
+
+
+
+/* Fractional delay line.  The first FDELAY_GUARD samples are mirrored
+ * past the end of the buffer, so the taps of an interpolated read are
+ * always contiguous: only the start of a read is wrapped, once.
+ * Positions count from the oldest sample like read_buffer(), so n == 0
+ * is the oldest and n == buflen-1 the sample pushed last.
+ */
+
+#define FDELAY_GUARD    4
+
+/* interpolation modes; each plugin picks one as PM_INTERP or
+   DELAY_INTERP, which can be overridden from CFLAGS */
+#define FDELAY_LINEAR   0
+#define FDELAY_HERMITE  1
+#define FDELAY_ALLPASS  2
+
+typedef struct {
+        float * buffer;         /* buflen + FDELAY_GUARD samples */
+        unsigned long buflen;
+        unsigned long pos;      /* oldest sample, overwritten next */
+} fdelay;
+
+typedef float v4sf __attribute__((vector_size(16)));
+
+
+/* use buffer, of buflen + FDELAY_GUARD samples, as the delay line */
+static inline
+void
+fdelay_init(fdelay * d, float * buffer, unsigned long buflen) {
+
+        d->buffer = buffer;
+        d->buflen = buflen;
+        d->pos = 0;
+}
+
+
+static inline
+void
+fdelay_clear(fdelay * d) {
+
+        memset(d->buffer, 0, (d->buflen + FDELAY_GUARD) * sizeof(float));
+}
+
+
+static inline
+void
+fdelay_push(fdelay * d, float insample) {
+
+        d->buffer[d->pos] = insample;
+        if (d->pos < FDELAY_GUARD)
+                d->buffer[d->buflen + d->pos] = insample;
+        if (++d->pos >= d->buflen)
+                d->pos = 0;
+}
+
+
+/* buffer index of the sample n after the oldest, n < buflen */
+static inline
+unsigned long
+fdelay_index(const fdelay * d, unsigned long n) {
+
+        unsigned long i = d->pos + n;
+
+        return (i >= d->buflen) ? i - d->buflen : i;
+}
+
+
+static inline
+float
+fdelay_read(const fdelay * d, unsigned long n) {
+
+        return d->buffer[fdelay_index(d, n)];
+}
+
+
+static inline
+float
+fdelay_read_linear(const fdelay * d, float x) {
+
+        const float * p;
+        unsigned long n;
+
+        x = LIMIT(x, 0.0f, (float)(d->buflen - 1));
+        n = (unsigned long)x;
+        x -= n;
+        p = d->buffer + fdelay_index(d, n);
+
+        return p[0] + x * (p[1] - p[0]);
+}
+
+
+/* 4-point, 3rd-order Hermite between p[1] and p[2] */
+static inline
+float
+hermite(const float * p, float f) {
+
+        const float c1 = 0.5f * (p[2] - p[0]);
+        const float c2 = p[0] - 2.5f * p[1] + 2.0f * p[2] - 0.5f * p[3];
+        const float c3 = 0.5f * (p[3] - p[0]) + 1.5f * (p[1] - p[2]);
+
+        return ((c3 * f + c2) * f + c1) * f + p[1];
+}
+
+
+static inline
+float
+fdelay_read_hermite(const fdelay * d, float x) {
+
+        unsigned long n;
+
+        x = LIMIT(x, 1.0f, (float)(d->buflen - 3));
+        n = (unsigned long)x;
+
+        return hermite(d->buffer + fdelay_index(d, n - 1), x - n);
+}
+
+
+/* First order allpass interpolation: flat magnitude, but the filter
+ * has a state, kept by the caller for each tap.  Best for taps that
+ * move slowly; the delay behind the newer sample stays in 0.5 .. 1.5,
+ * where the coefficient is well behaved.
+ */
+static inline
+float
+fdelay_read_allpass(const fdelay * d, float x, float * state) {
+
+        const float * p;
+        unsigned long n;
+        float a, eta;
+
+        x = LIMIT(x, 0.0f, (float)(d->buflen - 2));
+        n = (unsigned long)x;
+        a = 1.0f - (x - n);
+        if (a < 0.5f) {
+                n++;
+                a += 1.0f;
+        }
+        p = d->buffer + fdelay_index(d, n);
+        eta = (1.0f - a) / (1.0f + a);
+
+        return *state = eta * (p[1] - *state) + p[0];
+}
+
+
+/* interpolated read, mode is meant to be a constant chosen by the plugin */
+static inline
+float
+fdelay_read_frac(const fdelay * d, float x, int mode, float * state) {
+
+        switch (mode) {
+        case FDELAY_HERMITE:
+                return fdelay_read_hermite(d, x);
+        case FDELAY_ALLPASS:
+                return fdelay_read_allpass(d, x, state);
+        default:
+                return fdelay_read_linear(d, x);
+        }
+}
+
+
+/* Four interpolated reads at once, from the same or different lines.
+ * The Hermite mode computes the four taps in parallel with vectors
+ * (SSE or NEON, whatever the compiler targets).
+ */
+static inline
+v4sf
+fdelay_read_frac4(const fdelay * const d[4], const float x[4], int mode, float state[4]) {
+
+        const float * p[4];
+        v4sf f, xm, x0, x1, x2, c1, c2, c3, y;
+        unsigned long n;
+        float t;
+        int i;
+
+        if (mode != FDELAY_HERMITE) {
+                for (i = 0; i < 4; i++)
+                        y[i] = fdelay_read_frac(d[i], x[i], mode, &state[i]);
+                return y;
+        }
+
+        for (i = 0; i < 4; i++) {
+                t = LIMIT(x[i], 1.0f, (float)(d[i]->buflen - 3));
+                n = (unsigned long)t;
+                f[i] = t - n;
+                p[i] = d[i]->buffer + fdelay_index(d[i], n - 1);
+        }
+
+        xm = (v4sf){ p[0][0], p[1][0], p[2][0], p[3][0] };
+        x0 = (v4sf){ p[0][1], p[1][1], p[2][1], p[3][1] };
+        x1 = (v4sf){ p[0][2], p[1][2], p[2][2], p[3][2] };
+        x2 = (v4sf){ p[0][3], p[1][3], p[2][3], p[3][3] };
+
+        c1 = 0.5f * (x1 - xm);
+        c2 = xm - 2.5f * x0 + 2.0f * x1 - 0.5f * x2;
+        c3 = 0.5f * (x2 - xm) + 1.5f * (x0 - x1);
+
+        return ((c3 * f + c2) * f + c1) * f + x0;
+}
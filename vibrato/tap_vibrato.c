@@ -54,6 +54,11 @@
 
 #define PM_FREQ 30.0f
 
+/* interpolation of the modulated delay line */
+#ifndef PM_INTERP
+#define PM_INTERP FDELAY_HERMITE
+#endif
+
 
 #define COS_TABLE_SIZE 1024
 float cos_table[COS_TABLE_SIZE];
@@ -71,9 +76,8 @@ typedef struct {
     float * input;
     float * output;
 
-    float * ringbuffer;
-    unsigned long buflen;
-    unsigned long pos;
+    fdelay line;
+    float interp_state;
     float phase;
 
     double sample_rate;
@@ -93,10 +97,12 @@ instantiate_Vibrato(const LV2_Descriptor * Descriptor, double SampleRate, const
     {
         plugin->sample_rate = SampleRate;
 
-        plugin->ringbuffer = calloc(2 * PM_DEPTH, sizeof(float));
-        if (!plugin) return NULL;
-        plugin->buflen = ceil(0.2f * SampleRate / M_PI);
-        plugin->pos = 0;
+        float * buffer = calloc(2 * PM_DEPTH, sizeof(float));
+        if (!buffer) {
+            free(plugin);
+            return NULL;
+        }
+        fdelay_init(&plugin->line, buffer, ceil(0.2f * SampleRate / M_PI));
 
         if(flag == 0)
         {
@@ -119,10 +125,9 @@ void
 activate_Vibrato(LV2_Handle Instance) {
 
     Vibrato * ptr = (Vibrato *)Instance;
-    unsigned long i;
 
-    for (i = 0; i < 2 * PM_DEPTH; i++)
-        ptr->ringbuffer[i] = 0.0f;
+    fdelay_clear(&ptr->line);
+    ptr->interp_state = 0.0f;
 
     ptr->phase = 0.0f;
 }
@@ -179,7 +184,7 @@ run_Vibrato(LV2_Handle Instance,
     float freq = LIMIT(*(ptr->freq),0.0f,PM_FREQ);
     float depth =
         LIMIT(LIMIT(*(ptr->depth),0.0f,20.0f) * ptr->sample_rate / 200.0f / M_PI / freq,
-              0, ptr->buflen / 2);
+              0, ptr->line.buflen / 2);
     float drylevel = db2lin(LIMIT(*(ptr->drylevel),-90.0f,20.0f));
     float wetlevel = db2lin(LIMIT(*(ptr->wetlevel),-90.0f,20.0f));
     float * input = ptr->input;
@@ -191,9 +196,6 @@ run_Vibrato(LV2_Handle Instance,
     float in = 0.0f;
     float phase = 0.0f;
     float fpos = 0.0f;
-    float n = 0.0f;
-    float rem = 0.0f;
-    float s_a, s_b;
 
 
     if (freq == 0.0f)
@@ -206,18 +208,13 @@ run_Vibrato(LV2_Handle Instance,
         while (phase >= COS_TABLE_SIZE)
                 phase -= COS_TABLE_SIZE;
 
-        push_buffer(in, ptr->ringbuffer, ptr->buflen, &(ptr->pos));
+        fdelay_push(&ptr->line, in);
 
         fpos = depth * (1.0f - cos_table[(unsigned long) phase]);
-        n = floorf(fpos);
-        rem = fpos - n;
-
-        s_a = read_buffer(ptr->ringbuffer, ptr->buflen, ptr->pos, (unsigned long) n);
-        s_b = read_buffer(ptr->ringbuffer, ptr->buflen, ptr->pos, (unsigned long) n + 1);
 
-        *(output++) = wetlevel * ((1 - rem) * s_a + rem * s_b) +
-            drylevel * read_buffer(ptr->ringbuffer, ptr->buflen,
-                           ptr->pos, ptr->buflen / 2);
+        *(output++) =
+            wetlevel * fdelay_read_frac(&ptr->line, fpos, PM_INTERP, &ptr->interp_state) +
+            drylevel * fdelay_read(&ptr->line, ptr->line.buflen / 2);
 
     }
 
@@ -225,7 +222,7 @@ run_Vibrato(LV2_Handle Instance,
     while (ptr->phase >= COS_TABLE_SIZE)
         ptr->phase -= COS_TABLE_SIZE;
 
-    *(ptr->latency) = ptr->buflen / 2;
+    *(ptr->latency) = ptr->line.buflen / 2;
 
 }
 
@@ -234,7 +231,7 @@ void
 cleanup_Vibrato(LV2_Handle Instance) {
 
     Vibrato * ptr = (Vibrato *)Instance;
-    free(ptr->ringbuffer);
+    free(ptr->line.buffer);
     free(Instance);
 }
 